@@ -12,7 +12,16 @@
 # when I compiled with -O1, -O2 and -O3, but maybe it's because aggresive
 # optimizations eliminated the code completely)
 
-CHM_SRCS="src/chm_lib.c src/lzx.c"
+CHM_SRCS="src/chm_lib.c src/lzx.c src/lzx_pool.c src/block_cache.c"
+LIBS="-lpthread"
+
+## Encodings chm_http can keep precompressed responses in (any combination)
+# CHM_HTTP_GZIP:   gzip, needs zlib
+# CHM_HTTP_BROTLI: brotli, needs libbrotlienc
+# CHM_HTTP_ZSTD:   zstd, needs libzstd
+#
+#HTTP_FLAGS="-DCHM_HTTP_GZIP -lz -DCHM_HTTP_BROTLI -lbrotlienc -DCHM_HTTP_ZSTD -lzstd"
+HTTP_FLAGS=""
 
 clang_rel()
 {
@@ -21,10 +30,11 @@ clang_rel()
   CFLAGS="-g -fsanitize=address -O0 -Isrc -Weverything -Wno-format-nonliteral -Wno-padded -Wno-conversion"
   OUT=obj/clang/rel
   mkdir -p $OUT
-  $CC -o $OUT/test $CFLAGS $CHM_SRCS tools/test.c tools/sha1.c
-  $CC -o $OUT/extract $CFLAGS $CHM_SRCS tools/extract.c
-  $CC -o $OUT/enum $CFLAGS $CHM_SRCS tools/enum.c
-  $CC -o $OUT/chm_http $CFLAGS $CHM_SRCS tools/chm_http.c
+  $CC -o $OUT/test $CFLAGS $CHM_SRCS tools/test.c tools/sha1.c $LIBS
+  $CC -o $OUT/extract $CFLAGS $CHM_SRCS tools/extract.c $LIBS
+  $CC -o $OUT/enum $CFLAGS $CHM_SRCS tools/enum.c $LIBS
+  $CC -o $OUT/chm_http $CFLAGS $CHM_SRCS tools/chm_http.c $LIBS $HTTP_FLAGS
+  $CC -o $OUT/bench $CFLAGS $CHM_SRCS tools/bench.c $LIBS
 }
 
 build_afl()
@@ -34,10 +44,10 @@ build_afl()
   CFLAGS="-g -fsanitize=address -O3 -Isrc -Weverything -Wno-format-nonliteral -Wno-padded -Wno-conversion"
   OUT=obj/afl/rel
   mkdir -p $OUT
-  $CC -o $OUT/test $CFLAGS $CHM_SRCS tools/test.c tools/sha1.c
-  #$CC -o $OUT/extract $CFLAGS $CHM_SRCS tools/extract.c
-  #$CC -o $OUT/enum $CFLAGS $CHM_SRCS tools/enum.c
-  #$CC -o $OUT/chm_http $CFLAGS $CHM_SRCS tools/chm_http.c
+  $CC -o $OUT/test $CFLAGS $CHM_SRCS tools/test.c tools/sha1.c $LIBS
+  #$CC -o $OUT/extract $CFLAGS $CHM_SRCS tools/extract.c $LIBS
+  #$CC -o $OUT/enum $CFLAGS $CHM_SRCS tools/enum.c $LIBS
+  #$CC -o $OUT/chm_http $CFLAGS $CHM_SRCS tools/chm_http.c $LIBS $HTTP_FLAGS
 }
 
 clang_rel_one()
@@ -47,8 +57,8 @@ clang_rel_one()
   CFLAGS="-g -fsanitize=address -O0 -Isrc -Weverything -Wno-format-nonliteral -Wno-padded -Wno-conversion"
   OUT=obj/clang/rel
   mkdir -p $OUT
-  $CC -o $OUT/test $CFLAGS $CHM_SRCS tools/test.c tools/sha1.c
-  #$CC -o $OUT/chm_http $CFLAGS $CHM_SRCS tools/chm_http.c
+  $CC -o $OUT/test $CFLAGS $CHM_SRCS tools/test.c tools/sha1.c $LIBS
+  #$CC -o $OUT/chm_http $CFLAGS $CHM_SRCS tools/chm_http.c $LIBS $HTTP_FLAGS
 }
 
 clang_dbg()
@@ -58,10 +68,11 @@ clang_dbg()
   CFLAGS="-g -fsanitize=address -O0 -Isrc -Weverything -Wno-format-nonliteral -Wno-padded -Wno-conversion"
   OUT=obj/clang/dbg
   mkdir -p $OUT
-  $CC -o $OUT/test $CFLAGS $CHM_SRCS tools/test.c tools/sha1.c
-  $CC -o $OUT/extract $CFLAGS $CHM_SRCS tools/extract.c
-  $CC -o $OUT/enum $CFLAGS $CHM_SRCS tools/enum.c
-  $CC -o $OUT/chm_http $CFLAGS $CHM_SRCS tools/chm_http.c
+  $CC -o $OUT/test $CFLAGS $CHM_SRCS tools/test.c tools/sha1.c $LIBS
+  $CC -o $OUT/extract $CFLAGS $CHM_SRCS tools/extract.c $LIBS
+  $CC -o $OUT/enum $CFLAGS $CHM_SRCS tools/enum.c $LIBS
+  $CC -o $OUT/chm_http $CFLAGS $CHM_SRCS tools/chm_http.c $LIBS $HTTP_FLAGS
+  $CC -o $OUT/bench $CFLAGS $CHM_SRCS tools/bench.c $LIBS
 }
 
 gcc_rel()
@@ -72,8 +83,9 @@ gcc_rel()
   CFLAGS="-g -O3 -Isrc -Wall -Wextra -Wpedantic"
   OUT=obj/gcc/rel
   mkdir -p $OUT
-  $CC -o $OUT/test $CFLAGS $CHM_SRCS tools/test.c tools/sha1.c
-  $CC -o $OUT/extract $CFLAGS $CHM_SRCS tools/extract.c
-  $CC -o $OUT/enum $CFLAGS $CHM_SRCS tools/enum.c
-  $CC -o $OUT/chm_http $CFLAGS $CHM_SRCS tools/chm_http.c
+  $CC -o $OUT/test $CFLAGS $CHM_SRCS tools/test.c tools/sha1.c $LIBS
+  $CC -o $OUT/extract $CFLAGS $CHM_SRCS tools/extract.c $LIBS
+  $CC -o $OUT/enum $CFLAGS $CHM_SRCS tools/enum.c $LIBS
+  $CC -o $OUT/chm_http $CFLAGS $CHM_SRCS tools/chm_http.c $LIBS $HTTP_FLAGS
+  $CC -o $OUT/bench $CFLAGS $CHM_SRCS tools/bench.c $LIBS
 }
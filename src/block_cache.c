@@ -0,0 +1,385 @@
+/***************************************************************************
+ *             block_cache.c - cache for decompressed blocks               *
+ *                           -------------------                           *
+ *                                                                         *
+ *  notes:      ARC keeps two lists of cached blocks: T1 for blocks seen   *
+ *              once recently and T2 for blocks seen at least twice. Two   *
+ *              more "ghost" lists (B1, B2) remember only the keys of      *
+ *              blocks recently evicted from T1 and T2. A miss that hits a *
+ *              ghost list shifts the T1/T2 balance (target_t1) towards    *
+ *              the list that would have kept the block. All sizes are in  *
+ *              bytes, so blocks of different sizes are weighted fairly.   *
+ *              With the LRU policy only T1 is used.                       *
+ ***************************************************************************/
+
+/***************************************************************************
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU Lesser General Public License as        *
+ *   published by the Free Software Foundation; either version 2.1 of the  *
+ *   License, or (at your option) any later version.                       *
+ *                                                                         *
+ ***************************************************************************/
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "block_cache.h"
+
+enum { LIST_T1, LIST_T2, LIST_B1, LIST_B2, LIST_COUNT };
+
+typedef struct cache_node {
+    struct cache_node* prev;  /* towards the MRU end */
+    struct cache_node* next;  /* towards the LRU end */
+    struct cache_node* hnext; /* hash chain */
+    uint64_t archive;
+    int64_t block;
+    uint8_t* data; /* NULL for ghost entries */
+    size_t size;
+    int list;
+} cache_node;
+
+typedef struct cache_list {
+    cache_node* mru;
+    cache_node* lru;
+    int64_t bytes;
+    int count;
+} cache_list;
+
+struct block_cache {
+    int policy;
+    int64_t budget;
+    int64_t target_t1; /* ARC's p, in bytes */
+    cache_list lists[LIST_COUNT];
+
+    cache_node** buckets;
+    uint32_t n_buckets; /* power of 2 */
+    int n_nodes;
+    cache_node* free_nodes;
+
+    /* last evicted buffer, reused by the next put of the same size */
+    uint8_t* spare;
+    size_t spare_size;
+
+    int64_t hits;
+    int64_t misses;
+    int64_t evictions;
+};
+
+static uint32_t key_hash(uint64_t archive, int64_t block) {
+    uint64_t k = archive ^ ((uint64_t)block * 0x9E3779B97F4A7C15ull);
+    k ^= k >> 32;
+    k *= 0xD6E8FEB86659FD93ull;
+    k ^= k >> 32;
+    return (uint32_t)k;
+}
+
+static cache_node* find_node(struct block_cache* c, uint64_t archive, int64_t block) {
+    cache_node* n = c->buckets[key_hash(archive, block) & (c->n_buckets - 1)];
+    while (n != NULL && (n->archive != archive || n->block != block)) {
+        n = n->hnext;
+    }
+    return n;
+}
+
+static void hash_insert(struct block_cache* c, cache_node* n) {
+    uint32_t idx = key_hash(n->archive, n->block) & (c->n_buckets - 1);
+    n->hnext = c->buckets[idx];
+    c->buckets[idx] = n;
+}
+
+static void hash_remove(struct block_cache* c, cache_node* n) {
+    cache_node** p = &c->buckets[key_hash(n->archive, n->block) & (c->n_buckets - 1)];
+    while (*p != n) {
+        p = &(*p)->hnext;
+    }
+    *p = n->hnext;
+}
+
+/* keep the chains short; failing to grow only makes lookups slower */
+static void maybe_grow_buckets(struct block_cache* c) {
+    if ((uint32_t)c->n_nodes <= c->n_buckets) {
+        return;
+    }
+    uint32_t n_buckets = c->n_buckets * 2;
+    cache_node** buckets = (cache_node**)calloc(n_buckets, sizeof(cache_node*));
+    if (buckets == NULL) {
+        return;
+    }
+    cache_node** old = c->buckets;
+    uint32_t n_old = c->n_buckets;
+    c->buckets = buckets;
+    c->n_buckets = n_buckets;
+    for (uint32_t i = 0; i < n_old; i++) {
+        cache_node* n = old[i];
+        while (n != NULL) {
+            cache_node* next = n->hnext;
+            hash_insert(c, n);
+            n = next;
+        }
+    }
+    free(old);
+}
+
+static void list_unlink(struct block_cache* c, cache_node* n) {
+    cache_list* l = &c->lists[n->list];
+    if (n->prev) {
+        n->prev->next = n->next;
+    } else {
+        l->mru = n->next;
+    }
+    if (n->next) {
+        n->next->prev = n->prev;
+    } else {
+        l->lru = n->prev;
+    }
+    l->bytes -= (int64_t)n->size;
+    l->count--;
+}
+
+static void list_push_mru(struct block_cache* c, cache_node* n, int list) {
+    cache_list* l = &c->lists[list];
+    n->list = list;
+    n->prev = NULL;
+    n->next = l->mru;
+    if (l->mru) {
+        l->mru->prev = n;
+    } else {
+        l->lru = n;
+    }
+    l->mru = n;
+    l->bytes += (int64_t)n->size;
+    l->count++;
+}
+
+static uint8_t* alloc_data(struct block_cache* c, size_t size) {
+    if (c->spare != NULL && c->spare_size == size) {
+        uint8_t* d = c->spare;
+        c->spare = NULL;
+        return d;
+    }
+    return (uint8_t*)malloc(size);
+}
+
+static void release_data(struct block_cache* c, uint8_t* d, size_t size) {
+    if (c->spare == NULL) {
+        c->spare = d;
+        c->spare_size = size;
+    } else {
+        free(d);
+    }
+}
+
+static void free_node(struct block_cache* c, cache_node* n) {
+    list_unlink(c, n);
+    hash_remove(c, n);
+    if (n->data) {
+        release_data(c, n->data, n->size);
+    }
+    n->hnext = c->free_nodes;
+    c->free_nodes = n;
+    c->n_nodes--;
+}
+
+static int64_t resident_bytes(struct block_cache* c) {
+    return c->lists[LIST_T1].bytes + c->lists[LIST_T2].bytes;
+}
+
+/* evict the LRU block of T1 or T2. with ARC it becomes a ghost in B1 or B2 */
+static void evict(struct block_cache* c, int list) {
+    cache_node* n = c->lists[list].lru;
+    c->evictions++;
+    if (c->policy != CHM_CACHE_ARC) {
+        free_node(c, n);
+        return;
+    }
+    list_unlink(c, n);
+    release_data(c, n->data, n->size);
+    n->data = NULL;
+    list_push_mru(c, n, list == LIST_T1 ? LIST_B1 : LIST_B2);
+}
+
+/* ARC's REPLACE: evict from T1 if it's over its target, from T2 otherwise */
+static void replace(struct block_cache* c, bool hitB2) {
+    cache_list* t1 = &c->lists[LIST_T1];
+    if (t1->count > 0 && (t1->bytes > c->target_t1 || (hitB2 && t1->bytes == c->target_t1) ||
+                          c->lists[LIST_T2].count == 0)) {
+        evict(c, LIST_T1);
+    } else {
+        evict(c, LIST_T2);
+    }
+}
+
+static void make_room(struct block_cache* c, size_t size, bool hitB2) {
+    while (resident_bytes(c) + (int64_t)size > c->budget &&
+           c->lists[LIST_T1].count + c->lists[LIST_T2].count > 0) {
+        if (c->policy == CHM_CACHE_ARC) {
+            replace(c, hitB2);
+        } else {
+            evict(c, LIST_T1);
+        }
+    }
+}
+
+/* ghosts only remember up to budget bytes for T1+B1 and 2*budget in total */
+static void trim_ghosts(struct block_cache* c) {
+    cache_list* b1 = &c->lists[LIST_B1];
+    cache_list* b2 = &c->lists[LIST_B2];
+    while (b1->count > 0 && c->lists[LIST_T1].bytes + b1->bytes > c->budget) {
+        free_node(c, b1->lru);
+    }
+    while (b1->count + b2->count > 0 && resident_bytes(c) + b1->bytes + b2->bytes > 2 * c->budget) {
+        free_node(c, b2->count > 0 ? b2->lru : b1->lru);
+    }
+}
+
+struct block_cache* block_cache_new(int64_t budget, int policy) {
+    struct block_cache* c = (struct block_cache*)calloc(1, sizeof(struct block_cache));
+    if (c == NULL) {
+        return NULL;
+    }
+    c->n_buckets = 64;
+    c->buckets = (cache_node**)calloc(c->n_buckets, sizeof(cache_node*));
+    if (c->buckets == NULL) {
+        free(c);
+        return NULL;
+    }
+    c->budget = budget < 0 ? 0 : budget;
+    c->policy = policy;
+    return c;
+}
+
+void block_cache_free(struct block_cache* c) {
+    if (c == NULL) {
+        return;
+    }
+    for (int i = 0; i < LIST_COUNT; i++) {
+        while (c->lists[i].count > 0) {
+            free_node(c, c->lists[i].lru);
+        }
+    }
+    while (c->free_nodes != NULL) {
+        cache_node* next = c->free_nodes->hnext;
+        free(c->free_nodes);
+        c->free_nodes = next;
+    }
+    free(c->spare);
+    free(c->buckets);
+    free(c);
+}
+
+void block_cache_configure(struct block_cache* c, int64_t budget, int policy) {
+    if (policy != c->policy) {
+        /* forget ARC's history, keep the blocks themselves in T1 */
+        while (c->lists[LIST_B1].count > 0) {
+            free_node(c, c->lists[LIST_B1].lru);
+        }
+        while (c->lists[LIST_B2].count > 0) {
+            free_node(c, c->lists[LIST_B2].lru);
+        }
+        while (c->lists[LIST_T2].count > 0) {
+            cache_node* n = c->lists[LIST_T2].lru;
+            list_unlink(c, n);
+            list_push_mru(c, n, LIST_T1);
+        }
+        c->target_t1 = 0;
+        c->policy = policy;
+    }
+    c->budget = budget < 0 ? 0 : budget;
+    if (c->target_t1 > c->budget) {
+        c->target_t1 = c->budget;
+    }
+    make_room(c, 0, false);
+    trim_ghosts(c);
+}
+
+int block_cache_policy(struct block_cache* c) {
+    return c->policy;
+}
+
+uint8_t* block_cache_get(struct block_cache* c, uint64_t archive, int64_t block) {
+    cache_node* n = find_node(c, archive, block);
+    if (n == NULL || n->data == NULL) {
+        c->misses++;
+        return NULL;
+    }
+    c->hits++;
+    list_unlink(c, n);
+    list_push_mru(c, n, c->policy == CHM_CACHE_ARC ? LIST_T2 : LIST_T1);
+    return n->data;
+}
+
+uint8_t* block_cache_put(struct block_cache* c, uint64_t archive, int64_t block, size_t size) {
+    cache_node* n = find_node(c, archive, block);
+    if (n != NULL && n->data != NULL) {
+        if (n->size != size) {
+            block_cache_drop(c, archive, block);
+            return block_cache_put(c, archive, block, size);
+        }
+        list_unlink(c, n);
+        list_push_mru(c, n, c->policy == CHM_CACHE_ARC ? LIST_T2 : LIST_T1);
+        return n->data;
+    }
+
+    int list = LIST_T1;
+    if (n != NULL) {
+        /* a ghost hit: adapt the T1 target towards the list that would have kept it */
+        int64_t b1 = c->lists[LIST_B1].bytes;
+        int64_t b2 = c->lists[LIST_B2].bytes;
+        bool hitB2 = n->list == LIST_B2;
+        if (hitB2) {
+            int64_t delta = b2 >= b1 ? (int64_t)size : (int64_t)size * b1 / b2;
+            c->target_t1 = c->target_t1 > delta ? c->target_t1 - delta : 0;
+        } else {
+            int64_t delta = b1 >= b2 ? (int64_t)size : (int64_t)size * b2 / b1;
+            c->target_t1 = c->target_t1 + delta < c->budget ? c->target_t1 + delta : c->budget;
+        }
+        /* off all lists while making room, so it can't be evicted or trimmed */
+        list_unlink(c, n);
+        make_room(c, size, hitB2);
+        list = LIST_T2;
+    } else {
+        make_room(c, size, false);
+        if (c->free_nodes != NULL) {
+            n = c->free_nodes;
+            c->free_nodes = n->hnext;
+        } else {
+            n = (cache_node*)malloc(sizeof(cache_node));
+            if (n == NULL) {
+                return NULL;
+            }
+        }
+        n->archive = archive;
+        n->block = block;
+        hash_insert(c, n);
+        c->n_nodes++;
+    }
+
+    n->size = size;
+    n->data = alloc_data(c, size);
+    list_push_mru(c, n, list);
+    if (n->data == NULL) {
+        free_node(c, n);
+        return NULL;
+    }
+    trim_ghosts(c);
+    maybe_grow_buckets(c);
+    return n->data;
+}
+
+void block_cache_drop(struct block_cache* c, uint64_t archive, int64_t block) {
+    cache_node* n = find_node(c, archive, block);
+    if (n != NULL) {
+        free_node(c, n);
+    }
+}
+
+void block_cache_get_stats(struct block_cache* c, chm_cache_stats* stats) {
+    memset(stats, 0, sizeof(chm_cache_stats));
+    stats->hits = c->hits;
+    stats->misses = c->misses;
+    stats->evictions = c->evictions;
+    stats->bytes = resident_bytes(c);
+    stats->budget = c->budget;
+    stats->n_blocks = c->lists[LIST_T1].count + c->lists[LIST_T2].count;
+}
@@ -0,0 +1,61 @@
+/***************************************************************************
+ *             block_cache.h - cache for decompressed blocks               *
+ *                           -------------------                           *
+ *                                                                         *
+ *  notes:      Blocks are keyed by (archive, block index) and can have    *
+ *              different sizes. The cache is sized in bytes and evicts    *
+ *              with either plain LRU or ARC (Adaptive Replacement Cache,  *
+ *              Megiddo & Modha), weighted by block size.                  *
+ *                                                                         *
+ *              Not thread-safe; callers serialize access.                 *
+ ***************************************************************************/
+
+/***************************************************************************
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU Lesser General Public License as        *
+ *   published by the Free Software Foundation; either version 2.1 of the  *
+ *   License, or (at your option) any later version.                       *
+ *                                                                         *
+ ***************************************************************************/
+
+#ifndef INCLUDED_BLOCK_CACHE_H
+#define INCLUDED_BLOCK_CACHE_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include "chm_lib.h"
+
+/* opaque cache structure */
+struct block_cache;
+
+/* create a cache holding up to budget bytes, policy is CHM_CACHE_LRU or CHM_CACHE_ARC */
+struct block_cache* block_cache_new(int64_t budget, int policy);
+
+/* free the cache and all cached blocks */
+void block_cache_free(struct block_cache* c);
+
+/* change budget and/or policy, evicting blocks that no longer fit */
+void block_cache_configure(struct block_cache* c, int64_t budget, int policy);
+
+int block_cache_policy(struct block_cache* c);
+
+/* returns cached block data or NULL. valid until the next block_cache_put() */
+uint8_t* block_cache_get(struct block_cache* c, uint64_t archive, int64_t block);
+
+/* make room for a block of size bytes and return a buffer for it. at least
+ * one block is always admitted, even if it's bigger than the budget */
+uint8_t* block_cache_put(struct block_cache* c, uint64_t archive, int64_t block, size_t size);
+
+/* forget a block, e.g. after failing to fill the buffer returned by block_cache_put() */
+void block_cache_drop(struct block_cache* c, uint64_t archive, int64_t block);
+
+void block_cache_get_stats(struct block_cache* c, chm_cache_stats* stats);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* INCLUDED_BLOCK_CACHE_H */
@@ -44,6 +44,7 @@
 #include <limits.h>
 #include <stdio.h>
 #include <stdarg.h>
+#include <errno.h>
 
 #ifdef WIN32
 #include <windows.h>
@@ -58,11 +59,15 @@
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <fcntl.h>
+#include <sys/mman.h>
 /* #include <dmalloc.h> */
 #endif
 
 #include "chm_lib.h"
 #include "lzx.h"
+#include "lzx_pool.h"
+#include "block_cache.h"
+#include "chm_thread.h"
 
 #ifndef CHM_MAX_BLOCKS_CACHED
 #define CHM_MAX_BLOCKS_CACHED 5
@@ -81,6 +86,18 @@
 
 #define CHM_MAX_PATHLEN 512
 
+/* smallest and largest chunk for the directory entries arena */
+#define CHM_ARENA_MIN_CHUNK (16 * 1024)
+#define CHM_ARENA_MAX_CHUNK (8 * 1024 * 1024)
+
+/* directory entries and their paths are carved out of a few big chunks
+ * instead of being allocated one by one. chunk data follows the header */
+typedef struct chm_arena_chunk {
+    struct chm_arena_chunk* next;
+    size_t size;
+    size_t used;
+} chm_arena_chunk;
+
 /* structure of PMGL headers */
 static const char _chm_pmgl_marker[4] = "PMGL";
 #define CHM_PMGL_LEN 0x14
@@ -92,6 +109,17 @@ typedef struct pgml_hdr {
     int32_t block_next;    /* 10 */
 } pgml_hdr;
 
+/* structure of PMGI headers */
+static const char _chm_pmgi_marker[4] = "PMGI";
+#define CHM_PMGI_LEN 0x08
+typedef struct pmgi_hdr {
+    char signature[4];   /*  0 (PMGI) */
+    uint32_t free_space; /*  4 */
+} pmgi_hdr;
+
+/* the PMGI tree is never this deep, guards against loops in broken files */
+#define CHM_MAX_INDEX_DEPTH 32
+
 /* structure of LZXC reset table */
 #define CHM_LZXC_RESETTABLE_V1_LEN 0x28
 
@@ -139,16 +167,8 @@ void fd_reader_close(fd_reader_ctx* ctx) {
     }
 }
 
-#if 0
-int64_t fd_reader(void* ctx_arg, void* buf, int64_t off, int64_t len) {
-  fd_reader_ctx *ctx = (fd_reader_ctx*)ctx_arg;
-  if (ctx->fd == -1) {
-    return -1;
-  }
-  return pread64(ctx->fd, buf, (long)len, off);
-}
-#endif
-
+#ifdef WIN32
+/* no pread on windows: not safe to call from multiple threads, use win_reader */
 int64_t fd_reader(void* ctx_arg, void* buf, int64_t off, int64_t len) {
     fd_reader_ctx* ctx = (fd_reader_ctx*)ctx_arg;
     if (ctx->fd == -1) {
@@ -160,6 +180,109 @@ int64_t fd_reader(void* ctx_arg, void* buf, int64_t off, int64_t len) {
     lseek(ctx->fd, (long)oldOff, SEEK_SET);
     return n;
 }
+#else
+/* positional reads don't touch the file offset, so multiple threads can read
+ * through the same fd_reader_ctx at once */
+int64_t fd_reader(void* ctx_arg, void* buf, int64_t off, int64_t len) {
+    fd_reader_ctx* ctx = (fd_reader_ctx*)ctx_arg;
+    if (ctx->fd == -1 || off < 0 || len < 0) {
+        return -1;
+    }
+    uint8_t* d = (uint8_t*)buf;
+    int64_t total = 0;
+    while (total < len) {
+        ssize_t n = pread(ctx->fd, d + total, (size_t)(len - total), (off_t)(off + total));
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        if (n == 0) {
+            /* end of file */
+            break;
+        }
+        total += n;
+    }
+    return total;
+}
+#endif
+
+#ifdef WIN32
+bool mmap_reader_init(mmap_reader_ctx* ctx, const char* path) {
+    LARGE_INTEGER size;
+    ctx->data = NULL;
+    ctx->size = 0;
+    ctx->mapping = NULL;
+    ctx->fh = CreateFileA(path, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING,
+                          FILE_ATTRIBUTE_NORMAL, NULL);
+    if (ctx->fh == INVALID_HANDLE_VALUE) {
+        return false;
+    }
+    if (!GetFileSizeEx(ctx->fh, &size) || size.QuadPart == 0) {
+        goto Error;
+    }
+    ctx->mapping = CreateFileMappingA(ctx->fh, NULL, PAGE_READONLY, 0, 0, NULL);
+    if (ctx->mapping == NULL) {
+        goto Error;
+    }
+    ctx->data = MapViewOfFile(ctx->mapping, FILE_MAP_READ, 0, 0, 0);
+    if (ctx->data == NULL) {
+        goto Error;
+    }
+    ctx->size = size.QuadPart;
+    return true;
+Error:
+    mmap_reader_close(ctx);
+    return false;
+}
+
+void mmap_reader_close(mmap_reader_ctx* ctx) {
+    if (ctx->data != NULL) {
+        UnmapViewOfFile(ctx->data);
+    }
+    if (ctx->mapping != NULL) {
+        CloseHandle(ctx->mapping);
+    }
+    if (ctx->fh != INVALID_HANDLE_VALUE) {
+        CloseHandle(ctx->fh);
+    }
+    ctx->data = NULL;
+    ctx->size = 0;
+}
+#else
+bool mmap_reader_init(mmap_reader_ctx* ctx, const char* path) {
+    struct stat st;
+    ctx->data = NULL;
+    ctx->size = 0;
+    int fd = open(path, O_RDONLY);
+    if (fd == -1) {
+        return false;
+    }
+    /* the mapping stays valid after the fd is closed */
+    if (fstat(fd, &st) == 0 && st.st_size > 0) {
+        void* d = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+        if (d != MAP_FAILED) {
+            ctx->data = d;
+            ctx->size = (int64_t)st.st_size;
+        }
+    }
+    close(fd);
+    return ctx->data != NULL;
+}
+
+void mmap_reader_close(mmap_reader_ctx* ctx) {
+    if (ctx->data != NULL) {
+        munmap(ctx->data, (size_t)ctx->size);
+    }
+    ctx->data = NULL;
+    ctx->size = 0;
+}
+#endif
+
+int64_t mmap_reader(void* ctx, void* buf, int64_t off, int64_t len) {
+    return mem_reader(ctx, buf, off, len);
+}
 
 #ifdef WIN32
 bool win_reader_init(win_reader_ctx* ctx, const WCHAR* path) {
@@ -174,29 +297,38 @@ void win_reader_close(win_reader_ctx* ctx) {
     }
 }
 
+/* reads at an explicit offset (OVERLAPPED on a synchronous handle) instead of
+ * moving the file pointer, so multiple threads can read at once */
 int64_t win_reader(void* ctx_arg, void* buf, int64_t off, int64_t len) {
     win_reader_ctx* ctx = (win_reader_ctx*)ctx_arg;
-    int64_t n = 0, oldOs = 0;
-    if (ctx->fh == INVALID_HANDLE_VALUE)
+    if (ctx->fh == INVALID_HANDLE_VALUE || off < 0 || len < 0)
         return -1;
 
-    /* NOTE: this might be better done with CreateFileMapping, et cetera... */
-    DWORD origOffsetLo = 0, origOffsetHi = 0;
-    DWORD offsetLo, offsetHi;
-    DWORD actualLen = 0;
-
-    offsetLo = (unsigned int)(off & 0xffffffffL);
-    offsetHi = (unsigned int)((off >> 32) & 0xffffffffL);
-    origOffsetLo = SetFilePointer(ctx->fh, 0, &origOffsetHi, FILE_CURRENT);
-    offsetLo = SetFilePointer(ctx->fh, offsetLo, &offsetHi, FILE_BEGIN);
-
-    if (ReadFile(ctx->fh, buf, (DWORD)len, &actualLen, NULL) == TRUE)
-        n = actualLen;
-    else
-        n = -1;
-
-    SetFilePointer(ctx->fh, origOffsetLo, &origOffsetHi, FILE_BEGIN);
-    return n;
+    uint8_t* d = (uint8_t*)buf;
+    int64_t total = 0;
+    while (total < len) {
+        OVERLAPPED ov;
+        DWORD actualLen = 0;
+        int64_t pos = off + total;
+        int64_t toRead = len - total;
+        if (toRead > 0x40000000) {
+            toRead = 0x40000000;
+        }
+        memset(&ov, 0, sizeof(ov));
+        ov.Offset = (DWORD)(pos & 0xffffffff);
+        ov.OffsetHigh = (DWORD)((pos >> 32) & 0xffffffff);
+        if (!ReadFile(ctx->fh, d + total, (DWORD)toRead, &actualLen, &ov)) {
+            if (GetLastError() == ERROR_HANDLE_EOF) {
+                break;
+            }
+            return -1;
+        }
+        if (actualLen == 0) {
+            break;
+        }
+        total += actualLen;
+    }
+    return total;
 }
 #endif
 
@@ -452,6 +584,23 @@ static bool unmarshal_pmgl_header(unmarshaller* u, unsigned int blockLen, pgml_h
     return true;
 }
 
+static bool unmarshal_pmgi_header(unmarshaller* u, unsigned int blockLen, pmgi_hdr* hdr) {
+    if (blockLen < CHM_PMGI_LEN)
+        return false;
+
+    get_pchar(u, hdr->signature, 4);
+    hdr->free_space = get_uint32(u);
+
+    if (!memeq(hdr->signature, _chm_pmgi_marker, 4)) {
+        return false;
+    }
+    if (hdr->free_space > blockLen - CHM_PMGI_LEN) {
+        return false;
+    }
+
+    return true;
+}
+
 static bool unmarshal_lzxc_reset_table(unmarshaller* u, lzxc_reset_table* dest) {
     dest->version = get_uint32(u);
     dest->block_count = get_uint32(u);
@@ -539,18 +688,223 @@ static int64_t read_bytes(chm_file* h, uint8_t* buf, int64_t off, int64_t len) {
     return n;
 }
 
+/* returns a pointer to len bytes at off if the reader is backed by memory */
+static const uint8_t* map_bytes(chm_file* h, int64_t off, int64_t len) {
+    if (h->read_func != mmap_reader && h->read_func != mem_reader) {
+        return NULL;
+    }
+    /* mmap_reader_ctx starts with the same fields as mem_reader_ctx */
+    mem_reader_ctx* ctx = (mem_reader_ctx*)h->read_ctx;
+    if (off < 0 || len < 0 || off > ctx->size || len > ctx->size - off) {
+        return NULL;
+    }
+    return (const uint8_t*)ctx->data + off;
+}
+
 static bool is_null_or_compressed(chm_entry* e) {
     return (e == NULL) || (e->space == CHM_COMPRESSED);
 }
 
-static void free_entries(chm_entry* first) {
-    chm_entry* next;
-    chm_entry* e = first;
-    while (e != NULL) {
-        next = e->next;
-        free(e);
-        e = next;
+/* FNV-1a over the ASCII-lowercased path, to match streq() */
+static uint32_t path_hash(const char* path) {
+    uint32_t h = 2166136261u;
+    for (const uint8_t* s = (const uint8_t*)path; *s; s++) {
+        uint8_t c = *s;
+        if (c >= 'A' && c <= 'Z') {
+            c += 'a' - 'A';
+        }
+        h = (h ^ c) * 16777619u;
+    }
+    return h;
+}
+
+/* build an open-addressing index over h->entries. if a path appears more
+ * than once, the first entry wins, same as a linear scan */
+static bool build_entries_hash(chm_file* h) {
+    uint32_t size = 16;
+    while (size < (uint32_t)h->n_entries * 2) {
+        size <<= 1;
+    }
+    chm_entry** hash = (chm_entry**)calloc(size, sizeof(chm_entry*));
+    if (hash == NULL) {
+        return false;
+    }
+    uint32_t mask = size - 1;
+    for (int i = 0; i < h->n_entries; i++) {
+        chm_entry* e = h->entries[i];
+        uint32_t idx = path_hash(e->path) & mask;
+        while (hash[idx] != NULL && !streq(hash[idx]->path, e->path)) {
+            idx = (idx + 1) & mask;
+        }
+        if (hash[idx] == NULL) {
+            hash[idx] = e;
+        }
+    }
+    free(h->entries_hash);
+    h->entries_hash = hash;
+    h->entries_hash_mask = mask;
+    return true;
+}
+
+static void* arena_alloc(chm_file* h, size_t n) {
+    n = (n + 7) & ~(size_t)7;
+    chm_arena_chunk* c = h->entries_arena;
+    if (c == NULL || c->size - c->used < n) {
+        size_t size = h->entries_arena_chunk;
+        if (size < n) {
+            size = n;
+        }
+        c = (chm_arena_chunk*)malloc(sizeof(chm_arena_chunk) + size);
+        if (c == NULL) {
+            return NULL;
+        }
+        c->next = h->entries_arena;
+        c->size = size;
+        c->used = 0;
+        h->entries_arena = c;
+    }
+    void* res = (uint8_t*)(c + 1) + c->used;
+    c->used += n;
+    return res;
+}
+
+static void free_arena(chm_file* h) {
+    chm_arena_chunk* c = h->entries_arena;
+    while (c != NULL) {
+        chm_arena_chunk* next = c->next;
+        free(c);
+        c = next;
     }
+    h->entries_arena = NULL;
+}
+
+/* a decoder context for one read: chm_retrieve_entry() calls on the same
+ * handle from different threads each use their own. Contexts are reused
+ * (most recent first) so that a handle read from a single thread keeps
+ * decoding sequentially */
+typedef struct chm_decoder {
+    struct chm_decoder* next; /* in chm_sync.idle_decoders */
+    struct lzx_state* lzx;    /* borrowed from the pool during a read */
+    int64_t last_block;       /* last block lzx decoded, -1 if unknown */
+    /* compressed blocks are read here when they can't be mapped */
+    uint8_t* input;
+    /* blocks on their way into the cache are decoded here */
+    uint8_t* block;
+} chm_decoder;
+
+/* locks for reading through one handle from several threads */
+struct chm_sync {
+    chm_mutex lookup_mu;      /* chm_find_entry() in lazy mode */
+    chm_mutex decoders_mu;    /* idle_decoders */
+    chm_mutex checkpoints_mu; /* checkpoints, next_checkpoint */
+    chm_decoder* idle_decoders;
+};
+
+/* the block cache is split into stripes by block index, each with its own
+ * lock, so threads working on different blocks rarely wait for each other.
+ * blocks are copied in and out under the lock */
+struct chm_cache {
+    struct block_cache** stripes;
+    chm_mutex* locks;
+    int n_stripes;
+    int policy;
+};
+
+#define CHM_CACHE_MAX_STRIPES 16
+
+/* budget of the process-wide cache until chm_set_shared_cache_budget() */
+#define CHM_SHARED_CACHE_DEFAULT_BUDGET ((int64_t)64 * 1024 * 1024)
+
+/* the process-wide cache of chm_use_shared_cache(). created on first use and
+ * never freed, so handles can use it without holding g_shared_cache_mu */
+static chm_mutex g_shared_cache_mu = CHM_MUTEX_INITIALIZER;
+static struct chm_cache* g_shared_cache;
+
+static uint32_t cache_stripe(struct chm_cache* c, uint64_t archive, int64_t block) {
+    return (uint32_t)(((uint64_t)block + archive) % (uint64_t)c->n_stripes);
+}
+
+static void free_cache(struct chm_cache* c) {
+    if (c == NULL) {
+        return;
+    }
+    for (int i = 0; i < c->n_stripes; i++) {
+        block_cache_free(c->stripes[i]);
+        chm_mutex_destroy(&c->locks[i]);
+    }
+    free(c->stripes);
+    free(c->locks);
+    free(c);
+}
+
+/* each stripe admits at least one block, so small budgets get fewer stripes */
+static int cache_stripe_count(int64_t budget, int64_t blockLen) {
+    if (blockLen <= 0 || budget / (2 * blockLen) < 1) {
+        return 1;
+    }
+    if (budget / (2 * blockLen) > CHM_CACHE_MAX_STRIPES) {
+        return CHM_CACHE_MAX_STRIPES;
+    }
+    return (int)(budget / (2 * blockLen));
+}
+
+static struct chm_cache* new_cache(int n, int64_t budget, int policy) {
+    struct chm_cache* c = (struct chm_cache*)calloc(1, sizeof(struct chm_cache));
+    if (c == NULL) {
+        return NULL;
+    }
+    c->stripes = (struct block_cache**)calloc((size_t)n, sizeof(struct block_cache*));
+    c->locks = (chm_mutex*)calloc((size_t)n, sizeof(chm_mutex));
+    c->policy = policy;
+    if (c->stripes == NULL || c->locks == NULL) {
+        goto Error;
+    }
+    for (; c->n_stripes < n; c->n_stripes++) {
+        c->stripes[c->n_stripes] = block_cache_new(budget / n, policy);
+        if (c->stripes[c->n_stripes] == NULL) {
+            goto Error;
+        }
+        chm_mutex_init(&c->locks[c->n_stripes]);
+    }
+    return c;
+Error:
+    free_cache(c);
+    return NULL;
+}
+
+static struct chm_cache* handle_cache(chm_file* h) {
+    return h->shared_cache ? g_shared_cache : h->cache;
+}
+
+/* copy len bytes at off of a cached block to buf. false if not cached */
+static bool cache_read(chm_file* h, int64_t block, uint8_t* buf, int64_t off, int64_t len) {
+    struct chm_cache* c = handle_cache(h);
+    uint32_t i = cache_stripe(c, h->archive_id, block);
+    chm_mutex_lock(&c->locks[i]);
+    uint8_t* d = block_cache_get(c->stripes[i], h->archive_id, block);
+    if (d != NULL) {
+        memcpy(buf, d + off, (size_t)len);
+    }
+    chm_mutex_unlock(&c->locks[i]);
+    return d != NULL;
+}
+
+static void cache_store(chm_file* h, int64_t block, const uint8_t* data, size_t size) {
+    struct chm_cache* c = handle_cache(h);
+    uint32_t i = cache_stripe(c, h->archive_id, block);
+    chm_mutex_lock(&c->locks[i]);
+    uint8_t* d = block_cache_put(c->stripes[i], h->archive_id, block, size);
+    if (d != NULL) {
+        memcpy(d, data, size);
+    }
+    chm_mutex_unlock(&c->locks[i]);
+}
+
+static void free_decoder(chm_decoder* d) {
+    lzx_pool_forget(d);
+    free(d->input);
+    free(d->block);
+    free(d);
 }
 
 /* close an ITS archive */
@@ -559,82 +913,171 @@ void chm_close(chm_file* h) {
         return;
     }
 
-    if (h->lzx_state)
-        lzx_teardown(h->lzx_state);
+    chm_set_checkpoint_interval(h, 0, 0);
+    if (h->sync) {
+        while (h->sync->idle_decoders) {
+            chm_decoder* d = h->sync->idle_decoders;
+            h->sync->idle_decoders = d->next;
+            free_decoder(d);
+        }
+        chm_mutex_destroy(&h->sync->lookup_mu);
+        chm_mutex_destroy(&h->sync->decoders_mu);
+        chm_mutex_destroy(&h->sync->checkpoints_mu);
+        free(h->sync);
+        h->sync = NULL;
+    }
+
+    free_cache(h->cache);
+    h->cache = NULL;
+    free(h->block_offsets);
+    free(h->entries);
+    free_arena(h);
+    free(h->entries_hash);
+}
 
-    for (int i = 0; i < h->n_cache_blocks; i++) {
-        free(h->cache_blocks[i]);
-    }
-    if (h->entries != NULL) {
-        if (h->n_entries > 0) {
-            free_entries(h->entries[0]);
+void chm_set_cache_budget(chm_file* h, int64_t budget, int policy) {
+    int n = cache_stripe_count(budget, h->reset_table.block_len);
+    if (h->cache != NULL && h->cache->n_stripes == n) {
+        /* keep what's cached */
+        for (int i = 0; i < n; i++) {
+            block_cache_configure(h->cache->stripes[i], budget / n, policy);
         }
-        free(h->entries);
+        h->cache->policy = policy;
+        return;
+    }
+    struct chm_cache* c = new_cache(n, budget, policy);
+    if (c == NULL) {
+        return;
     }
+    free_cache(h->cache);
+    h->cache = c;
 }
 
-/*
- *  how many decompressed blocks should be cached?  A simple
- *  caching scheme is used, wherein the index of the block is
- *  used as a hash value, and hash collision results in the
- *  invalidation of the previously cached block.
- */
 void chm_set_cache_size(chm_file* h, int nCacheBlocks) {
-    if (nCacheBlocks == h->n_cache_blocks) {
+    int policy = CHM_CACHE_LRU;
+    if (h->cache != NULL) {
+        policy = h->cache->policy;
+    }
+    chm_set_cache_budget(h, (int64_t)nCacheBlocks * h->reset_table.block_len, policy);
+}
+
+static void get_cache_stats(struct chm_cache* c, chm_cache_stats* stats) {
+    memset(stats, 0, sizeof(chm_cache_stats));
+    if (c == NULL) {
         return;
     }
-    if (nCacheBlocks > MAX_CACHE_BLOCKS) {
-        nCacheBlocks = MAX_CACHE_BLOCKS;
+    for (int i = 0; i < c->n_stripes; i++) {
+        chm_cache_stats st;
+        chm_mutex_lock(&c->locks[i]);
+        block_cache_get_stats(c->stripes[i], &st);
+        chm_mutex_unlock(&c->locks[i]);
+        stats->hits += st.hits;
+        stats->misses += st.misses;
+        stats->evictions += st.evictions;
+        stats->bytes += st.bytes;
+        stats->budget += st.budget;
+        stats->n_blocks += st.n_blocks;
     }
-    uint8_t* newBlocks[MAX_CACHE_BLOCKS] = {0};
-    int64_t newIndices[MAX_CACHE_BLOCKS] = {0};
+}
 
-    /* re-distribute old cached blocks */
-    for (int i = 0; i < h->n_cache_blocks; i++) {
-        int newSlot = (int)(h->cache_block_indices[i] % nCacheBlocks);
+void chm_get_cache_stats(chm_file* h, chm_cache_stats* stats) {
+    get_cache_stats(handle_cache(h), stats);
+}
 
-        if (h->cache_blocks[i]) {
-            /* in case of collision, destroy newcomer */
-            if (newBlocks[newSlot]) {
-                free(h->cache_blocks[i]);
-                h->cache_blocks[i] = NULL;
-            } else {
-                newBlocks[newSlot] = h->cache_blocks[i];
-                newIndices[newSlot] = h->cache_block_indices[i];
-            }
-        }
+/* the shared cache always has all stripes, so that changing its budget never
+ * has to replace it under handles that are using it */
+static struct chm_cache* get_shared_cache(void) {
+    chm_mutex_lock(&g_shared_cache_mu);
+    if (g_shared_cache == NULL) {
+        g_shared_cache =
+            new_cache(CHM_CACHE_MAX_STRIPES, CHM_SHARED_CACHE_DEFAULT_BUDGET, CHM_CACHE_LRU);
+    }
+    chm_mutex_unlock(&g_shared_cache_mu);
+    return g_shared_cache;
+}
+
+bool chm_use_shared_cache(chm_file* h, bool use) {
+    if (use && get_shared_cache() == NULL) {
+        return false;
+    }
+    h->shared_cache = use;
+    return true;
+}
+
+void chm_set_shared_cache_budget(int64_t budget, int policy) {
+    struct chm_cache* c = get_shared_cache();
+    if (c == NULL) {
+        return;
     }
+    chm_mutex_lock(&g_shared_cache_mu);
+    for (int i = 0; i < c->n_stripes; i++) {
+        chm_mutex_lock(&c->locks[i]);
+        block_cache_configure(c->stripes[i], budget / c->n_stripes, policy);
+        chm_mutex_unlock(&c->locks[i]);
+    }
+    c->policy = policy;
+    chm_mutex_unlock(&g_shared_cache_mu);
+}
 
-    memcpy(h->cache_blocks, newBlocks, sizeof(newBlocks));
-    memcpy(h->cache_block_indices, newIndices, sizeof(newIndices));
-    h->n_cache_blocks = nCacheBlocks;
+void chm_get_shared_cache_stats(chm_cache_stats* stats) {
+    get_cache_stats(g_shared_cache, stats);
 }
 
-static uint8_t* get_cached_block(chm_file* h, int64_t nBlock) {
-    int idx = (int)nBlock % h->n_cache_blocks;
-    if (h->cache_blocks[idx] != NULL && h->cache_block_indices[idx] == nBlock) {
-        return h->cache_blocks[idx];
+/* FNV-1a */
+static uint64_t hash_bytes(uint64_t hash, const void* data, size_t len) {
+    const uint8_t* d = (const uint8_t*)data;
+    for (size_t i = 0; i < len; i++) {
+        hash ^= d[i];
+        hash *= 0x100000001B3ull;
     }
-    return NULL;
+    return hash;
 }
 
-static uint8_t* alloc_cached_block(chm_file* h, int64_t nBlock) {
-    int idx = (int)(nBlock % h->n_cache_blocks);
-    if (!h->cache_blocks[idx]) {
-        size_t blockSize = (size_t)h->reset_table.block_len;
-        h->cache_blocks[idx] = (uint8_t*)malloc(blockSize);
+static uint64_t hash_int64(uint64_t hash, int64_t v) {
+    uint8_t b[8];
+    for (int i = 0; i < 8; i++) {
+        b[i] = (uint8_t)((uint64_t)v >> (i * 8));
     }
-    if (h->cache_blocks[idx]) {
-        h->cache_block_indices[idx] = nBlock;
+    return hash_bytes(hash, b, sizeof(b));
+}
+
+/* identify the archive by what's in it rather than by path: the same file
+ * opened twice gets the same id, a rebuilt one (new timestamp, different
+ * sizes or block layout) a different one */
+static void compute_archive_id(chm_file* h) {
+    uint64_t id = 0xCBF29CE484222325ull;
+    id = hash_bytes(id, h->itsf.dir_uuid, sizeof(h->itsf.dir_uuid));
+    id = hash_bytes(id, h->itsf.stream_uuid, sizeof(h->itsf.stream_uuid));
+    id = hash_bytes(id, h->itsp.system_uuid, sizeof(h->itsp.system_uuid));
+    id = hash_int64(id, h->itsf.last_modified);
+    id = hash_int64(id, h->itsf.lang_id);
+    id = hash_int64(id, h->itsf.dir_len);
+    id = hash_int64(id, h->itsf.data_offset);
+    if (h->cn_unit != NULL) {
+        id = hash_int64(id, h->cn_unit->start);
+        id = hash_int64(id, h->cn_unit->length);
+    }
+    id = hash_int64(id, h->reset_table.uncompressed_len);
+    id = hash_int64(id, h->reset_table.compressed_len);
+    id = hash_int64(id, h->reset_table.block_len);
+    id = hash_int64(id, h->reset_table.block_count);
+    if (h->block_offsets != NULL) {
+        for (uint32_t i = 0; i <= h->reset_table.block_count; i++) {
+            id = hash_int64(id, h->block_offsets[i]);
+        }
     }
-    return h->cache_blocks[idx];
+    h->archive_id = id;
+}
+
+void chm_add_archive_id_data(chm_file* h, const void* data, size_t len) {
+    h->archive_id = hash_bytes(h->archive_id, data, len);
 }
 
 static int flags_from_path(char* path) {
     int flags = 0;
     size_t n = strlen(path);
 
-    if (path[n - 1] == '/')
+    if (n > 0 && path[n - 1] == '/')
         flags |= CHM_ENUMERATE_DIRS;
     else
         flags |= CHM_ENUMERATE_FILES;
@@ -649,18 +1092,19 @@ static int flags_from_path(char* path) {
     return flags;
 }
 
-static chm_entry* parse_pmgl_entry(unmarshaller* u) {
+static chm_entry* parse_pmgl_entry(chm_file* h, unmarshaller* u) {
     size_t pathLen = (size_t)get_cword(u);
     if (pathLen > CHM_MAX_PATHLEN || !u->ok) {
         return NULL;
     }
     size_t n = sizeof(chm_entry) + pathLen + 1; /* +1 to nul-terminate */
-    chm_entry* e = (chm_entry*)calloc(1, n);
+    chm_entry* e = (chm_entry*)arena_alloc(h, n);
     if (e == NULL) {
         return NULL;
     }
     e->path = (char*)e + sizeof(chm_entry);
     get_pchar(u, e->path, (int)pathLen);
+    e->path[pathLen] = 0;
     e->space = (int)get_cword(u);
     e->start = get_cword(u);
     e->length = get_cword(u);
@@ -671,62 +1115,103 @@ static chm_entry* parse_pmgl_entry(unmarshaller* u) {
     return e;
 }
 
-static bool get_int64_at_off(chm_file* h, int64_t off, int64_t* n_out) {
-    uint8_t buf[8];
-    if (read_bytes(h, buf, off, 8) != 8) {
-        return false;
-    }
-    unmarshaller u;
-    unmarshaller_init(&u, buf, 8);
-    int64_t n = get_int64(&u);
-    if (!u.ok) {
+/* get the bounds of a compressed block.  return false on failure */
+static bool get_cmpblock_bounds(chm_file* h, int64_t block, int64_t* start, int64_t* len) {
+    if (block < 0 || block >= h->reset_table.block_count) {
         return false;
     }
-    *n_out = n;
+    *start = h->block_offsets[block];
+    *len = h->block_offsets[block + 1] - *start;
+    *start += h->itsf.data_offset + h->cn_unit->start;
     return true;
 }
 
-/* get the bounds of a compressed block.  return false on failure */
-static bool get_cmpblock_bounds(chm_file* h, int64_t block, int64_t* start, int64_t* len) {
-    int64_t off = (int64_t)h->itsf.data_offset + (int64_t)h->rt_unit->start +
-                  (int64_t)h->reset_table.table_offset + (int64_t)block * 8;
-    if (!get_int64_at_off(h, off, start)) {
-        return false;
+struct chm_checkpoint {
+    int64_t block; /* next block to decode after restoring snap */
+    struct lzx_snapshot* snap;
+};
+
+bool chm_set_checkpoint_interval(chm_file* h, int nBlocks, int maxCheckpoints) {
+    bool ok = true;
+    if (h->sync) {
+        chm_mutex_lock(&h->sync->checkpoints_mu);
+    }
+    for (int i = 0; i < h->n_checkpoints; i++) {
+        lzx_snapshot_free(h->checkpoints[i].snap);
+    }
+    free(h->checkpoints);
+    h->checkpoints = NULL;
+    h->n_checkpoints = 0;
+    h->next_checkpoint = 0;
+    h->checkpoint_interval = 0;
+    if (nBlocks > 0 && maxCheckpoints > 0) {
+        h->checkpoints = (struct chm_checkpoint*)calloc((size_t)maxCheckpoints,
+                                                        sizeof(struct chm_checkpoint));
+        if (h->checkpoints == NULL) {
+            ok = false;
+        } else {
+            h->n_checkpoints = maxCheckpoints;
+            h->checkpoint_interval = nBlocks;
+        }
+    }
+    if (h->sync) {
+        chm_mutex_unlock(&h->sync->checkpoints_mu);
     }
+    return ok;
+}
 
-    /* for all but the last block, use the reset table */
-    int64_t end = h->reset_table.compressed_len;
-    if (block < h->reset_table.block_count - 1) {
-        off += 8;
-        if (!get_int64_at_off(h, off, &end)) {
-            return false;
+/* called with the decoder positioned right before nBlock */
+static void save_checkpoint(chm_file* h, chm_decoder* d, int64_t nBlock) {
+    uint32_t blockAlign = (uint32_t)(nBlock % h->reset_blkcount);
+    /* at a reset point there's nothing to save */
+    if (blockAlign == 0 || blockAlign % (uint32_t)h->checkpoint_interval != 0) {
+        return;
+    }
+    chm_mutex_lock(&h->sync->checkpoints_mu);
+    for (int i = 0; i < h->n_checkpoints; i++) {
+        if (h->checkpoints[i].snap != NULL && h->checkpoints[i].block == nBlock) {
+            chm_mutex_unlock(&h->sync->checkpoints_mu);
+            return;
         }
     }
-
-    *len = end - *start;
-    *start += h->itsf.data_offset + h->cn_unit->start;
-    return true;
+    struct chm_checkpoint* cp = &h->checkpoints[h->next_checkpoint];
+    cp->snap = lzx_snapshot(d->lzx, cp->snap);
+    cp->block = nBlock;
+    h->next_checkpoint = (h->next_checkpoint + 1) % h->n_checkpoints;
+    chm_mutex_unlock(&h->sync->checkpoints_mu);
 }
 
-static uint8_t* uncompress_block(chm_file* h, int64_t nBlock) {
-    size_t blockSize = (size_t)h->reset_table.block_len;
-    // TODO: cache buf on chm_file
-
-    if (h->lzx_last_block == nBlock) {
-        return h->lzx_last_block_data;
+/* restore the latest checkpoint in (first, nBlock]. returns the block to continue
+ * decoding from, first if there's no such checkpoint */
+static int64_t restore_checkpoint(chm_file* h, chm_decoder* d, int64_t first, int64_t nBlock) {
+    struct chm_checkpoint* best = NULL;
+    chm_mutex_lock(&h->sync->checkpoints_mu);
+    for (int i = 0; i < h->n_checkpoints; i++) {
+        struct chm_checkpoint* cp = &h->checkpoints[i];
+        if (cp->snap != NULL && cp->block > first && cp->block <= nBlock &&
+            (best == NULL || cp->block > best->block)) {
+            best = cp;
+        }
     }
-
-    if (nBlock % h->reset_blkcount == 0) {
-        lzx_reset(h->lzx_state);
+    if (best != NULL) {
+        lzx_restore(d->lzx, best->snap);
+        d->last_block = best->block - 1;
+        first = best->block;
     }
+    chm_mutex_unlock(&h->sync->checkpoints_mu);
+    return first;
+}
 
-    uint8_t* buf = malloc(blockSize + 6144);
-    if (buf == NULL)
-        return NULL;
+/* decode block nBlock into out (block_len bytes). lzx must be positioned right
+ * before nBlock. scratch holds a compressed block (block_len + 6144 bytes) or is
+ * NULL to allocate one when needed */
+static bool decode_block(chm_file* h, struct lzx_state* lzx, int64_t nBlock, uint8_t* out,
+                         uint8_t* scratch) {
+    size_t blockSize = (size_t)h->reset_table.block_len;
+    uint8_t* buf = NULL;
 
-    uint8_t* uncompressed = alloc_cached_block(h, nBlock);
-    if (!uncompressed) {
-        goto Error;
+    if (nBlock % h->reset_blkcount == 0) {
+        lzx_reset(lzx);
     }
 
     dbgprintf("Decompressing block #%4d (EXTRA)\n", nBlock);
@@ -738,57 +1223,136 @@ static uint8_t* uncompress_block(chm_file* h, int64_t nBlock) {
         goto Error;
     }
 
-    if (read_bytes(h, buf, cmpStart, cmpLen) != cmpLen) {
-        goto Error;
+    /* the decoder never reads past the end of its input, so a mapped block
+     * can be decoded in place */
+    uint8_t* cmp = (uint8_t*)map_bytes(h, cmpStart, cmpLen);
+    if (cmp == NULL) {
+        if (scratch == NULL) {
+            buf = malloc(blockSize + 6144);
+            if (buf == NULL) {
+                goto Error;
+            }
+            scratch = buf;
+        }
+        if (read_bytes(h, scratch, cmpStart, cmpLen) != cmpLen) {
+            goto Error;
+        }
+        cmp = scratch;
     }
 
-    int res = lzx_decompress(h->lzx_state, buf, uncompressed, (int)cmpLen, (int)blockSize);
+    int res = lzx_decompress(lzx, cmp, out, (int)cmpLen, (int)blockSize);
     if (res != DECR_OK) {
         dbgprintf("   (DECOMPRESS FAILED!)\n");
         goto Error;
     }
-
-    h->lzx_last_block = (int)nBlock;
-    h->lzx_last_block_data = uncompressed;
     free(buf);
-    return uncompressed;
+    return true;
 Error:
     free(buf);
-    return NULL;
+    return false;
 }
 
-static int64_t decompress_block(chm_file* h, int64_t nBlock, uint8_t** ubuffer) {
-    uint32_t blockAlign = ((uint32_t)nBlock % h->reset_blkcount); /* reset intvl. aln. */
+/* decode nBlock into out, or into the cache if out is NULL */
+static bool uncompress_block(chm_file* h, chm_decoder* d, int64_t nBlock, uint8_t* out) {
+    size_t blockSize = (size_t)h->reset_table.block_len;
+    uint8_t* uncompressed = out ? out : d->block;
+    if (!decode_block(h, d->lzx, nBlock, uncompressed, d->input)) {
+        /* the decoder state is unknown now, start over from a reset point next time */
+        d->last_block = -1;
+        return false;
+    }
+    if (!out) {
+        cache_store(h, nBlock, uncompressed, blockSize);
+    }
 
-    /* let the caching system pull its weight! */
-    if (nBlock - blockAlign <= h->lzx_last_block && nBlock >= h->lzx_last_block)
-        blockAlign = (uint32_t)(nBlock - h->lzx_last_block);
+    d->last_block = nBlock;
+    if (h->checkpoint_interval > 0) {
+        save_checkpoint(h, d, nBlock + 1);
+    }
+    return true;
+}
 
-    /* check if we need previous blocks */
-    if (blockAlign != 0) {
-        /* fetch all required previous blocks since last reset */
-        for (uint32_t i = blockAlign; i > 0; i--) {
-            uint8_t* d = uncompress_block(h, nBlock - i);
-            if (!d) {
-                return 0;
-            }
+/* decode nBlock into out (see uncompress_block()), first decoding whatever
+ * blocks before it the decoder needs */
+static bool decompress_block(chm_file* h, chm_decoder* d, int64_t nBlock, uint8_t* out) {
+    /* first block we have to decode: the start of the reset interval... */
+    int64_t first = nBlock - (int64_t)((uint32_t)nBlock % h->reset_blkcount);
+
+    /* ...unless the decoder is already past it... */
+    if (first <= d->last_block && nBlock > d->last_block)
+        first = d->last_block + 1;
+
+    /* ...or there's a checkpoint even closer */
+    if (h->checkpoint_interval > 0)
+        first = restore_checkpoint(h, d, first, nBlock);
+
+    /* fetch all required previous blocks */
+    for (int64_t i = first; i < nBlock; i++) {
+        if (!uncompress_block(h, d, i, NULL)) {
+            return false;
         }
     }
-    *ubuffer = uncompress_block(h, nBlock);
-    if (!*ubuffer) {
-        return 0;
+    return uncompress_block(h, d, nBlock, out);
+}
+
+/* take a decoder context for one read and borrow an LZX decoder for it from
+ * the pool. if the pool hands back the one this context used last, decoding
+ * resumes from where it stopped */
+static chm_decoder* get_decoder(chm_file* h) {
+    size_t blockSize = (size_t)h->reset_table.block_len;
+    chm_mutex_lock(&h->sync->decoders_mu);
+    chm_decoder* d = h->sync->idle_decoders;
+    if (d != NULL) {
+        h->sync->idle_decoders = d->next;
     }
+    chm_mutex_unlock(&h->sync->decoders_mu);
 
-    /* XXX: modify LZX routines to return the length of the data they
-     * decompressed and return that instead, for an extra sanity check.
-     */
-    return h->reset_table.block_len;
+    if (d == NULL) {
+        d = (chm_decoder*)calloc(1, sizeof(chm_decoder));
+        if (d == NULL) {
+            return NULL;
+        }
+        d->last_block = -1;
+        d->input = (uint8_t*)malloc(blockSize + 6144);
+        d->block = (uint8_t*)malloc(blockSize);
+        if (d->input == NULL || d->block == NULL) {
+            free_decoder(d);
+            return NULL;
+        }
+    }
+
+    bool resumed;
+    d->lzx = lzx_pool_acquire(ffs((int)h->window_size) - 1, d, &resumed);
+    if (!resumed) {
+        d->last_block = -1;
+    }
+    if (d->lzx == NULL) {
+        free_decoder(d);
+        return NULL;
+    }
+    return d;
+}
+
+static void put_decoder(chm_file* h, chm_decoder* d) {
+    if (d == NULL) {
+        return;
+    }
+    lzx_pool_release(d->lzx, ffs((int)h->window_size) - 1, d);
+    d->lzx = NULL;
+    chm_mutex_lock(&h->sync->decoders_mu);
+    d->next = h->sync->idle_decoders;
+    h->sync->idle_decoders = d;
+    chm_mutex_unlock(&h->sync->decoders_mu);
 }
 
-/* grab a region from a compressed block */
-static int64_t decompress_region(chm_file* h, uint8_t* buf, int64_t start, int64_t len) {
-    uint8_t* ubuffer;
+void chm_set_lzx_pool_limit(int64_t bytes) {
+    lzx_pool_set_limit(bytes);
+}
 
+/* grab a region from a compressed block. *d is the decoder for this read,
+ * taken on the first cache miss */
+static int64_t decompress_region(chm_file* h, chm_decoder** d, uint8_t* buf, int64_t start,
+                                 int64_t len) {
     if (len <= 0)
         return (int64_t)0;
 
@@ -799,25 +1363,25 @@ static int64_t decompress_region(chm_file* h, uint8_t* buf, int64_t start, int64
     if (nLen > (h->reset_table.block_len - nOffset))
         nLen = h->reset_table.block_len - nOffset;
 
-    uint8_t* cached_block = get_cached_block(h, nBlock);
-    if (cached_block != NULL) {
-        memcpy(buf, cached_block + nOffset, (size_t)nLen);
+    if (cache_read(h, nBlock, buf, nOffset, nLen)) {
         return nLen;
     }
 
-    if (!h->lzx_state) {
-        int window_size = ffs((int)h->window_size) - 1;
-        h->lzx_last_block = -1;
-        h->lzx_state = lzx_init(window_size);
+    if (*d == NULL && (*d = get_decoder(h)) == NULL) {
+        return 0;
     }
 
-    int64_t gotLen = decompress_block(h, nBlock, &ubuffer);
-    if (gotLen == (int64_t)-1) {
+    /* if the caller wants the whole block, decode it straight into buf
+     * instead of going through the cache. Large entries are read mostly
+     * this way and would only churn the cache anyway */
+    if (nOffset == 0 && nLen == h->reset_table.block_len) {
+        return decompress_block(h, *d, nBlock, buf) ? nLen : 0;
+    }
+
+    if (!decompress_block(h, *d, nBlock, NULL)) {
         return 0;
     }
-    if (gotLen < nLen)
-        nLen = gotLen;
-    memcpy(buf, ubuffer + nOffset, (unsigned int)nLen);
+    memcpy(buf, (*d)->block + nOffset, (size_t)nLen);
     return nLen;
 }
 
@@ -843,16 +1407,17 @@ int64_t chm_retrieve_entry(chm_file* h, chm_entry* e, unsigned char* buf, int64_
     }
 
     int64_t swath = 0, total = 0;
+    chm_decoder* d = NULL;
 
     /* if compression is not enabled for this file... */
     if (!h->compression_enabled)
         return total;
 
     do {
-        swath = decompress_region(h, buf, e->start + addr, len);
+        swath = decompress_region(h, &d, buf, e->start + addr, len);
 
         if (swath == 0)
-            return total;
+            break;
 
         /* update stats */
         total += swath;
@@ -862,20 +1427,551 @@ int64_t chm_retrieve_entry(chm_file* h, chm_entry* e, unsigned char* buf, int64_
 
     } while (len != 0);
 
+    put_decoder(h, d);
+    return total;
+}
+
+typedef struct batch_item {
+    chm_entry* e;
+    int idx; /* position in the caller's array, to keep the sort stable */
+    bool failed;
+} batch_item;
+
+static int cmp_batch_item(const void* a, const void* b) {
+    const batch_item* i1 = (const batch_item*)a;
+    const batch_item* i2 = (const batch_item*)b;
+    if (i1->e->space != i2->e->space) {
+        return i1->e->space < i2->e->space ? -1 : 1;
+    }
+    if (i1->e->start != i2->e->start) {
+        return i1->e->start < i2->e->start ? -1 : 1;
+    }
+    return i1->idx < i2->idx ? -1 : (i1->idx > i2->idx);
+}
+
+static bool batch_fail(batch_item* it, chm_batch_cb cb, void* ctx) {
+    it->failed = true;
+    return cb(ctx, it->idx, NULL, 0, 0);
+}
+
+static bool batch_uncompressed(chm_file* h, batch_item* it, uint8_t* buf, int64_t bufLen,
+                               chm_batch_cb cb, void* ctx) {
+    chm_entry* e = it->e;
+    int64_t start = (int64_t)h->itsf.data_offset + e->start;
+    const uint8_t* d = map_bytes(h, start, e->length);
+    if (d != NULL) {
+        return cb(ctx, it->idx, d, 0, e->length);
+    }
+    for (int64_t off = 0; off < e->length; off += bufLen) {
+        int64_t n = e->length - off < bufLen ? e->length - off : bufLen;
+        if (read_bytes(h, buf, start + off, n) != n) {
+            return batch_fail(it, cb, ctx);
+        }
+        if (!cb(ctx, it->idx, buf, off, n)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+/* items are sorted by start. every block any of them touches is decoded once,
+ * in order, and its bytes go to all the entries that overlap it */
+static bool batch_compressed(chm_file* h, batch_item* items, int n, uint8_t* block,
+                             chm_batch_cb cb, void* ctx) {
+    int64_t blockLen = h->reset_table.block_len;
+    chm_decoder* d = NULL;
+    bool ok = true;
+    int lo = 0; /* items before lo are done */
+    int64_t nBlock = -1;
+
+    while (ok && lo < n) {
+        if (nBlock < items[lo].e->start / blockLen) {
+            nBlock = items[lo].e->start / blockLen;
+        }
+        int64_t blockStart = nBlock * blockLen;
+        int64_t blockEnd = blockStart + blockLen;
+
+        /* when the decoder is right before this block, decoding beats breaking
+         * the sequence for a cache hit */
+        bool got = false;
+        if (!h->compression_enabled) {
+            got = false;
+        } else if ((d == NULL || d->last_block != nBlock - 1) &&
+                   cache_read(h, nBlock, block, 0, blockLen)) {
+            got = true;
+        } else if (d != NULL || (d = get_decoder(h)) != NULL) {
+            got = decompress_block(h, d, nBlock, block);
+        }
+
+        for (int i = lo; ok && i < n && items[i].e->start < blockEnd; i++) {
+            batch_item* it = &items[i];
+            chm_entry* e = it->e;
+            int64_t from = e->start > blockStart ? e->start : blockStart;
+            int64_t to = e->start + e->length < blockEnd ? e->start + e->length : blockEnd;
+            if (it->failed || from >= to) {
+                continue;
+            }
+            if (!got) {
+                ok = batch_fail(it, cb, ctx);
+            } else {
+                ok = cb(ctx, it->idx, block + (from - blockStart), from - e->start, to - from);
+            }
+        }
+        while (lo < n && (items[lo].failed || items[lo].e->start + items[lo].e->length <= blockEnd)) {
+            lo++;
+        }
+        nBlock++;
+    }
+    put_decoder(h, d);
+    return ok;
+}
+
+bool chm_retrieve_entries(chm_file* h, chm_entry** entries, int n, chm_batch_cb cb, void* ctx) {
+    if (h == NULL || n <= 0) {
+        return true;
+    }
+    batch_item* items = (batch_item*)malloc((size_t)n * sizeof(batch_item));
+    int64_t bufLen = h->reset_table.block_len > 65536 ? h->reset_table.block_len : 65536;
+    uint8_t* buf = (uint8_t*)malloc((size_t)bufLen);
+    bool ok = items != NULL && buf != NULL;
+
+    int nItems = 0;
+    for (int i = 0; ok && i < n; i++) {
+        chm_entry* e = entries[i];
+        if (e->length <= 0) {
+            continue;
+        }
+        if (e->space != CHM_UNCOMPRESSED && e->space != CHM_COMPRESSED) {
+            batch_item it = {e, i, false};
+            ok = batch_fail(&it, cb, ctx);
+            continue;
+        }
+        items[nItems].e = e;
+        items[nItems].idx = i;
+        items[nItems].failed = false;
+        nItems++;
+    }
+    if (ok) {
+        qsort(items, (size_t)nItems, sizeof(batch_item), cmp_batch_item);
+    }
+
+    int i = 0;
+    for (; ok && i < nItems && items[i].e->space == CHM_UNCOMPRESSED; i++) {
+        ok = batch_uncompressed(h, &items[i], buf, bufLen, cb, ctx);
+    }
+    if (ok && i < nItems) {
+        ok = batch_compressed(h, items + i, nItems - i, buf, cb, ctx);
+    }
+
+    free(buf);
+    free(items);
+    return ok;
+}
+
+/* a sequential reader over one entry. Compressed entries keep one decoder for
+ * the whole stream, so consecutive blocks never need a seek. With read-ahead
+ * a thread decodes the next block into next while the caller consumes cur */
+struct chm_stream {
+    chm_file* h;
+    chm_entry* e;
+    int64_t pos; /* offset in the entry of the next byte to return */
+
+    chm_decoder* d;
+    int64_t first_block;
+    int64_t last_block;
+    uint8_t* cur;
+    int64_t cur_block; /* block in cur, -1 if none */
+    bool failed;
+
+    bool read_ahead;
+    chm_thread thread;
+    chm_mutex mu;
+    chm_cond cv;
+    uint8_t* next;
+    int64_t next_block; /* block the thread decodes next */
+    bool next_ready;    /* next holds next_block - 1 */
+    bool next_ok;
+    bool stop;
+};
+
+/* the entry's first and last block usually hold the neighboring entries too,
+ * so those go through the cache. blocks in between only belong to this entry */
+static bool stream_fetch_block(chm_stream* s, int64_t nBlock, uint8_t* out) {
+    chm_file* h = s->h;
+    int64_t blockLen = h->reset_table.block_len;
+    if (cache_read(h, nBlock, out, 0, blockLen)) {
+        return true;
+    }
+    if (nBlock != s->first_block && nBlock != s->last_block) {
+        return decompress_block(h, s->d, nBlock, out);
+    }
+    if (!decompress_block(h, s->d, nBlock, NULL)) {
+        return false;
+    }
+    memcpy(out, s->d->block, (size_t)blockLen);
+    return true;
+}
+
+static void stream_read_ahead(void* arg) {
+    chm_stream* s = (chm_stream*)arg;
+    chm_mutex_lock(&s->mu);
+    for (;;) {
+        while (!s->stop && (s->next_ready || s->next_block > s->last_block)) {
+            chm_cond_wait(&s->cv, &s->mu);
+        }
+        if (s->stop) {
+            break;
+        }
+        int64_t nBlock = s->next_block;
+        chm_mutex_unlock(&s->mu);
+        bool ok = stream_fetch_block(s, nBlock, s->next);
+        chm_mutex_lock(&s->mu);
+        s->next_ok = ok;
+        s->next_ready = true;
+        s->next_block = ok ? nBlock + 1 : s->last_block + 1;
+        chm_cond_broadcast(&s->cv);
+    }
+    chm_mutex_unlock(&s->mu);
+}
+
+/* make nBlock, the block after cur_block, the current one */
+static bool stream_next_block(chm_stream* s, int64_t nBlock) {
+    if (!s->read_ahead) {
+        if (!stream_fetch_block(s, nBlock, s->cur)) {
+            s->failed = true;
+            return false;
+        }
+        s->cur_block = nBlock;
+        return true;
+    }
+    chm_mutex_lock(&s->mu);
+    while (!s->next_ready) {
+        chm_cond_wait(&s->cv, &s->mu);
+    }
+    bool ok = s->next_ok;
+    if (ok) {
+        uint8_t* tmp = s->cur;
+        s->cur = s->next;
+        s->next = tmp;
+        s->cur_block = nBlock;
+    }
+    s->next_ready = false;
+    s->failed = !ok;
+    chm_cond_broadcast(&s->cv);
+    chm_mutex_unlock(&s->mu);
+    return ok;
+}
+
+chm_stream* chm_stream_open(chm_file* h, chm_entry* e, bool readAhead) {
+    if (h == NULL || e == NULL) {
+        return NULL;
+    }
+    if (e->space != CHM_UNCOMPRESSED &&
+        (e->space != CHM_COMPRESSED || !h->compression_enabled)) {
+        return NULL;
+    }
+    chm_stream* s = (chm_stream*)calloc(1, sizeof(chm_stream));
+    if (s == NULL) {
+        return NULL;
+    }
+    s->h = h;
+    s->e = e;
+    s->cur_block = -1;
+    if (e->space == CHM_UNCOMPRESSED || e->length == 0) {
+        return s;
+    }
+
+    int64_t blockLen = h->reset_table.block_len;
+    s->first_block = e->start / blockLen;
+    s->last_block = (e->start + e->length - 1) / blockLen;
+    s->d = get_decoder(h);
+    s->cur = (uint8_t*)malloc((size_t)blockLen);
+    if (s->d == NULL || s->cur == NULL) {
+        goto Error;
+    }
+    /* a single block has nothing to read ahead */
+    if (!readAhead || s->first_block == s->last_block) {
+        return s;
+    }
+    s->next = (uint8_t*)malloc((size_t)blockLen);
+    if (s->next == NULL) {
+        goto Error;
+    }
+    s->next_block = s->first_block;
+    chm_mutex_init(&s->mu);
+    chm_cond_init(&s->cv);
+    if (!chm_thread_start(&s->thread, stream_read_ahead, s)) {
+        /* still works, just without read-ahead */
+        chm_cond_destroy(&s->cv);
+        chm_mutex_destroy(&s->mu);
+        return s;
+    }
+    s->read_ahead = true;
+    return s;
+Error:
+    chm_stream_close(s);
+    return NULL;
+}
+
+int64_t chm_stream_read(chm_stream* s, uint8_t* buf, int64_t len) {
+    chm_file* h = s->h;
+    chm_entry* e = s->e;
+    if (len > e->length - s->pos) {
+        len = e->length - s->pos;
+    }
+    if (len <= 0) {
+        return 0;
+    }
+    if (e->space == CHM_UNCOMPRESSED) {
+        int64_t n = read_bytes(h, buf, (int64_t)h->itsf.data_offset + e->start + s->pos, len);
+        if (n > 0) {
+            s->pos += n;
+        }
+        return n;
+    }
+
+    if (s->failed) {
+        return -1;
+    }
+    int64_t blockLen = h->reset_table.block_len;
+    int64_t total = 0;
+    while (total < len) {
+        int64_t off = e->start + s->pos;
+        int64_t nBlock = off / blockLen;
+        int64_t inBlock = off - nBlock * blockLen;
+        /* without read-ahead, whole blocks can go straight to buf */
+        if (!s->read_ahead && nBlock != s->cur_block && inBlock == 0 &&
+            len - total >= blockLen) {
+            if (!stream_fetch_block(s, nBlock, buf + total)) {
+                s->failed = true;
+                return total > 0 ? total : -1;
+            }
+            total += blockLen;
+            s->pos += blockLen;
+            continue;
+        }
+        if (nBlock != s->cur_block) {
+            if (!stream_next_block(s, nBlock)) {
+                return total > 0 ? total : -1;
+            }
+        }
+        int64_t n = blockLen - inBlock;
+        if (n > len - total) {
+            n = len - total;
+        }
+        memcpy(buf + total, s->cur + inBlock, (size_t)n);
+        total += n;
+        s->pos += n;
+    }
     return total;
 }
 
+void chm_stream_close(chm_stream* s) {
+    if (s == NULL) {
+        return;
+    }
+    if (s->read_ahead) {
+        chm_mutex_lock(&s->mu);
+        s->stop = true;
+        chm_cond_broadcast(&s->cv);
+        chm_mutex_unlock(&s->mu);
+        chm_thread_join(&s->thread);
+        chm_cond_destroy(&s->cv);
+        chm_mutex_destroy(&s->mu);
+    }
+    put_decoder(s->h, s->d);
+    free(s->cur);
+    free(s->next);
+    free(s);
+}
+
+/* shared by the threads of chm_decompress_range() */
+typedef struct decompress_job {
+    chm_file* h;
+    uint8_t* buf;
+    int64_t start;
+    int64_t end;
+    int64_t end_interval;
+
+    chm_mutex mu;
+    int64_t next_interval;
+    int64_t failed_block; /* lowest block that failed, INT64_MAX if none */
+} decompress_job;
+
+static void job_failed(decompress_job* job, int64_t nBlock) {
+    chm_mutex_lock(&job->mu);
+    if (nBlock < job->failed_block) {
+        job->failed_block = nBlock;
+    }
+    chm_mutex_unlock(&job->mu);
+}
+
+/* each thread takes whole reset intervals and decodes them with its own decoder */
+static void decompress_intervals(void* arg) {
+    decompress_job* job = (decompress_job*)arg;
+    chm_file* h = job->h;
+    int64_t blockLen = h->reset_table.block_len;
+    int64_t lastBlock = (job->end - 1) / blockLen;
+
+    int window = ffs((int)h->window_size) - 1;
+    bool resumed;
+    struct lzx_state* lzx = lzx_pool_acquire(window, NULL, &resumed);
+    uint8_t* scratch = (uint8_t*)malloc((size_t)blockLen + 6144);
+    uint8_t* tmp = (uint8_t*)malloc((size_t)blockLen);
+
+    for (;;) {
+        chm_mutex_lock(&job->mu);
+        int64_t interval = job->next_interval++;
+        int64_t failed = job->failed_block;
+        chm_mutex_unlock(&job->mu);
+
+        int64_t nBlock = interval * h->reset_blkcount;
+        if (interval >= job->end_interval || nBlock > failed) {
+            break;
+        }
+        if (lzx == NULL || scratch == NULL || tmp == NULL) {
+            job_failed(job, nBlock);
+            break;
+        }
+        int64_t endBlock = nBlock + h->reset_blkcount;
+        if (endBlock > lastBlock + 1) {
+            endBlock = lastBlock + 1;
+        }
+        for (; nBlock < endBlock; nBlock++) {
+            int64_t blockStart = nBlock * blockLen;
+            /* blocks that fit the range entirely are decoded in place */
+            bool inPlace = blockStart >= job->start && blockStart + blockLen <= job->end;
+            uint8_t* out = inPlace ? job->buf + (blockStart - job->start) : tmp;
+            if (!decode_block(h, lzx, nBlock, out, scratch)) {
+                job_failed(job, nBlock);
+                break;
+            }
+            if (inPlace || blockStart + blockLen <= job->start) {
+                continue;
+            }
+            int64_t from = blockStart > job->start ? blockStart : job->start;
+            int64_t to = blockStart + blockLen < job->end ? blockStart + blockLen : job->end;
+            memcpy(job->buf + (from - job->start), tmp + (from - blockStart), (size_t)(to - from));
+        }
+    }
+
+    free(tmp);
+    free(scratch);
+    lzx_pool_release(lzx, window, NULL);
+}
+
+int64_t chm_decompress_range(chm_file* h, uint8_t* buf, int64_t start, int64_t len,
+                             int nThreads) {
+    if (h == NULL || !h->compression_enabled || start < 0 || len <= 0 ||
+        h->reset_table.block_len <= 0) {
+        return 0;
+    }
+    if (start >= h->reset_table.uncompressed_len) {
+        return 0;
+    }
+    if (start + len > h->reset_table.uncompressed_len) {
+        len = h->reset_table.uncompressed_len - start;
+    }
+
+    decompress_job job;
+    memset(&job, 0, sizeof(job));
+    job.h = h;
+    job.buf = buf;
+    job.start = start;
+    job.end = start + len;
+    int64_t intervalLen = h->reset_table.block_len * h->reset_blkcount;
+    job.next_interval = start / intervalLen;
+    job.end_interval = (job.end - 1) / intervalLen + 1;
+    job.failed_block = INT64_MAX;
+    chm_mutex_init(&job.mu);
+
+    if (nThreads <= 0) {
+        nThreads = chm_cpu_count();
+    }
+    if (nThreads > job.end_interval - job.next_interval) {
+        nThreads = (int)(job.end_interval - job.next_interval);
+    }
+
+    /* the calling thread is one of the workers */
+    chm_thread* threads = NULL;
+    int nStarted = 0;
+    if (nThreads > 1) {
+        threads = (chm_thread*)calloc((size_t)nThreads - 1, sizeof(chm_thread));
+    }
+    while (threads != NULL && nStarted < nThreads - 1 &&
+           chm_thread_start(&threads[nStarted], decompress_intervals, &job)) {
+        nStarted++;
+    }
+    decompress_intervals(&job);
+    for (int i = 0; i < nStarted; i++) {
+        chm_thread_join(&threads[i]);
+    }
+    free(threads);
+    chm_mutex_destroy(&job.mu);
+
+    if (job.failed_block == INT64_MAX) {
+        return len;
+    }
+    int64_t got = job.failed_block * h->reset_table.block_len - start;
+    return got > 0 ? got : 0;
+}
+
+const uint8_t* chm_map_entry(chm_file* h, chm_entry* e) {
+    if (h == NULL || e == NULL || e->space != CHM_UNCOMPRESSED) {
+        return NULL;
+    }
+    return map_bytes(h, (int64_t)h->itsf.data_offset + e->start, e->length);
+}
+
+const uint8_t* chm_map_block(chm_file* h, int64_t nBlock, int64_t* len) {
+    int64_t cmpStart, cmpLen;
+    if (h == NULL || !h->compression_enabled || nBlock < 0 ||
+        nBlock >= h->reset_table.block_count) {
+        return NULL;
+    }
+    if (!get_cmpblock_bounds(h, nBlock, &cmpStart, &cmpLen)) {
+        return NULL;
+    }
+    const uint8_t* d = map_bytes(h, cmpStart, cmpLen);
+    if (d != NULL) {
+        *len = cmpLen;
+    }
+    return d;
+}
+
+static bool push_entry(chm_file* h, chm_entry* e) {
+    if (h->n_entries == h->entries_cap) {
+        int cap = h->entries_cap == 0 ? 64 : h->entries_cap * 2;
+        chm_entry** entries = (chm_entry**)realloc(h->entries, (size_t)cap * sizeof(chm_entry*));
+        if (entries == NULL) {
+            return false;
+        }
+        h->entries = entries;
+        h->entries_cap = cap;
+    }
+    h->entries[h->n_entries++] = e;
+    return true;
+}
+
 static bool parse_entries(chm_file* h) {
     pgml_hdr pgml;
 
-    int n_entries = 0;
     chm_entry* e;
-    chm_entry* last_entry = NULL;
     uint8_t* buf = malloc((size_t)h->itsp.block_len);
     if (buf == NULL) {
         goto Error;
     }
 
+    /* in memory an entry takes about twice its size in a PMGL page, so the
+     * whole directory usually fits in the first chunk */
+    size_t chunk = (size_t)h->dir_len * 2;
+    if (chunk < CHM_ARENA_MIN_CHUNK) {
+        chunk = CHM_ARENA_MIN_CHUNK;
+    } else if (chunk > CHM_ARENA_MAX_CHUNK) {
+        chunk = CHM_ARENA_MAX_CHUNK;
+    }
+    h->entries_arena_chunk = chunk;
+
     int32_t cur_page = h->itsp.index_head;
 
     while (cur_page != -1) {
@@ -893,37 +1989,24 @@ static bool parse_entries(chm_file* h) {
 
         /* decode all entries in this page */
         while (u.bytesLeft > 0) {
-            e = parse_pmgl_entry(&u);
-            if (e == NULL) {
+            e = parse_pmgl_entry(h, &u);
+            if (e == NULL || !push_entry(h, e)) {
                 goto Error;
             }
-            e->next = last_entry;
-            last_entry = e;
-            n_entries++;
         }
         cur_page = pgml.block_next;
     }
-    if (0 == n_entries) {
+    if (0 == h->n_entries) {
         goto Error;
     }
 
 Exit:
-    if (n_entries > 0) {
-        h->n_entries = n_entries;
-        chm_entry** entries = (chm_entry**)calloc((size_t)n_entries, sizeof(chm_entry*));
-        if (entries != NULL) {
-            h->entries = entries;
-            e = last_entry;
-            int n = n_entries - 1;
-            while (e != NULL) {
-                entries[n] = e;
-                --n;
-                e = e->next;
-            }
-        }
+    if (h->n_entries > 0) {
+        /* without the index lookups fall back to a linear scan */
+        build_entries_hash(h);
     }
     free(buf);
-    if (h->parse_entries_failed || n_entries == 0) {
+    if (h->parse_entries_failed || h->n_entries == 0) {
         return false;
     }
     return true;
@@ -932,6 +2015,201 @@ Error:
     goto Exit;
 }
 
+/* add an entry found by a lazy lookup to h->entries and the path index */
+static bool append_entry(chm_file* h, chm_entry* e) {
+    if (!push_entry(h, e)) {
+        return false;
+    }
+
+    if (h->entries_hash == NULL || (uint32_t)h->n_entries * 2 > h->entries_hash_mask + 1) {
+        return build_entries_hash(h);
+    }
+    uint32_t idx = path_hash(e->path) & h->entries_hash_mask;
+    while (h->entries_hash[idx] != NULL) {
+        idx = (idx + 1) & h->entries_hash_mask;
+    }
+    h->entries_hash[idx] = e;
+    return true;
+}
+
+/* compare a (not nul-terminated) directory name with path, like strcasecmp() */
+static int cmp_dir_name(const uint8_t* name, size_t nameLen, const char* path) {
+    int res = strncasecmp((const char*)name, path, nameLen);
+    if (res != 0) {
+        return res;
+    }
+    return strlen(path) > nameLen ? -1 : 0;
+}
+
+/* find path in a PMGI index block, returns the page to descend into or -1 */
+static int32_t find_in_pmgi(unmarshaller* u, const char* path) {
+    int32_t page = -1;
+    while (u->bytesLeft > 0) {
+        size_t nameLen = (size_t)get_cword(u);
+        uint8_t* name = eat_bytes(u, (int)nameLen);
+        if (name == NULL || nameLen > CHM_MAX_PATHLEN) {
+            return -1;
+        }
+        /* entries hold the first name of each child, so we're past it */
+        if (cmp_dir_name(name, nameLen, path) > 0) {
+            break;
+        }
+        page = (int32_t)get_cword(u);
+        if (!u->ok) {
+            return -1;
+        }
+    }
+    return page;
+}
+
+/* find path in a PMGL listing block. only the matching entry is allocated */
+static chm_entry* find_in_pmgl(chm_file* h, unmarshaller* u, const char* path) {
+    while (u->bytesLeft > 0) {
+        unmarshaller start = *u;
+        size_t nameLen = (size_t)get_cword(u);
+        uint8_t* name = eat_bytes(u, (int)nameLen);
+        if (name == NULL || nameLen > CHM_MAX_PATHLEN) {
+            return NULL;
+        }
+        if (cmp_dir_name(name, nameLen, path) == 0) {
+            return parse_pmgl_entry(h, &start);
+        }
+        get_cword(u);
+        get_cword(u);
+        get_cword(u);
+        if (!u->ok) {
+            return NULL;
+        }
+    }
+    return NULL;
+}
+
+/* descend the PMGI tree from the index root to the PMGL block that has path */
+static chm_entry* lookup_entry_in_dir(chm_file* h, const char* path) {
+    chm_entry* e = NULL;
+    int64_t n = h->itsp.block_len;
+    uint8_t* buf = malloc((size_t)n);
+    if (buf == NULL) {
+        return NULL;
+    }
+
+    int32_t cur_page = h->itsp.index_root;
+    for (int depth = 0; cur_page != -1 && depth < CHM_MAX_INDEX_DEPTH; depth++) {
+        if (read_bytes(h, buf, (int64_t)h->dir_offset + (int64_t)cur_page * n, n) != n) {
+            break;
+        }
+        unmarshaller u;
+        unmarshaller_init(&u, buf, (int)n);
+        if (memeq(buf, _chm_pmgl_marker, 4)) {
+            pgml_hdr pgml;
+            if (unmarshal_pmgl_header(&u, h->itsp.block_len, &pgml)) {
+                u.bytesLeft -= pgml.free_space;
+                e = find_in_pmgl(h, &u, path);
+            }
+            break;
+        }
+        pmgi_hdr pmgi;
+        if (!unmarshal_pmgi_header(&u, h->itsp.block_len, &pmgi)) {
+            break;
+        }
+        u.bytesLeft -= pmgi.free_space;
+        cur_page = find_in_pmgi(&u, path);
+    }
+    free(buf);
+    return e;
+}
+
+static chm_entry* find_entry(chm_file* h, const char* path) {
+    if (h->entries_hash == NULL) {
+        for (int i = 0; i < h->n_entries; i++) {
+            if (streq(h->entries[i]->path, path)) {
+                return h->entries[i];
+            }
+        }
+    } else {
+        uint32_t idx = path_hash(path) & h->entries_hash_mask;
+        while (h->entries_hash[idx] != NULL) {
+            if (streq(h->entries_hash[idx]->path, path)) {
+                return h->entries_hash[idx];
+            }
+            idx = (idx + 1) & h->entries_hash_mask;
+        }
+    }
+    if (!h->lazy_entries) {
+        return NULL;
+    }
+
+    if (h->entries_arena_chunk == 0) {
+        h->entries_arena_chunk = CHM_ARENA_MIN_CHUNK;
+    }
+    chm_entry* e = lookup_entry_in_dir(h, path);
+    if (e != NULL && !append_entry(h, e)) {
+        return NULL;
+    }
+    return e;
+}
+
+chm_entry* chm_find_entry(chm_file* h, const char* path) {
+    if (h == NULL || path == NULL) {
+        return NULL;
+    }
+    if (!h->lazy_entries) {
+        return find_entry(h, path);
+    }
+    /* lookups add entries, which moves entries and entries_hash around */
+    chm_mutex_lock(&h->sync->lookup_mu);
+    chm_entry* e = find_entry(h, path);
+    chm_mutex_unlock(&h->sync->lookup_mu);
+    return e;
+}
+
+/* read the whole table of block offsets once, so that finding a block
+ * doesn't take two tiny reads each time. the offsets are checked here, so
+ * that every block lies within the content section and none is larger than
+ * a decoder's input buffer */
+static bool read_block_offsets(chm_file* h) {
+    lzxc_reset_table* rt = &h->reset_table;
+    int64_t n = (int64_t)rt->block_count * 8;
+    int64_t maxCmpLen = rt->block_len + 6144;
+    if (rt->block_count == 0 || n > INT_MAX ||
+        (int64_t)rt->table_offset + n > h->rt_unit->length) {
+        return false;
+    }
+    if (rt->compressed_len > h->cn_unit->length) {
+        return false;
+    }
+
+    uint8_t* buf = malloc((size_t)n);
+    int64_t* offsets = malloc(((size_t)rt->block_count + 1) * sizeof(int64_t));
+    if (buf == NULL || offsets == NULL) {
+        goto Error;
+    }
+    if (chm_retrieve_entry(h, h->rt_unit, buf, rt->table_offset, n) != n) {
+        goto Error;
+    }
+    unmarshaller u;
+    unmarshaller_init(&u, buf, (int)n);
+    int64_t prev = 0;
+    for (uint32_t i = 0; i < rt->block_count; i++) {
+        offsets[i] = get_int64(&u);
+        if (!u.ok || offsets[i] < prev || (i > 0 && offsets[i] - prev > maxCmpLen)) {
+            goto Error;
+        }
+        prev = offsets[i];
+    }
+    if (prev > rt->compressed_len || rt->compressed_len - prev > maxCmpLen) {
+        goto Error;
+    }
+    offsets[rt->block_count] = rt->compressed_len;
+    free(buf);
+    h->block_offsets = offsets;
+    return true;
+Error:
+    free(buf);
+    free(offsets);
+    return false;
+}
+
 static bool parse_lzxc_reset_table(chm_file* h) {
     /* read reset table info */
     if (!h->compression_enabled) {
@@ -945,14 +2223,14 @@ static bool parse_lzxc_reset_table(chm_file* h) {
     }
     unmarshaller u;
     unmarshaller_init(&u, buf, (int)n);
-    if (!unmarshal_lzxc_reset_table(&u, &h->reset_table)) {
+    if (!unmarshal_lzxc_reset_table(&u, &h->reset_table) || !read_block_offsets(h)) {
         h->compression_enabled = false;
         return false;
     }
     return true;
 }
 
-bool chm_parse(chm_file* h, chm_reader read_func, void* read_ctx) {
+static bool parse(chm_file* h, chm_reader read_func, void* read_ctx, bool lazy) {
     unsigned char buf[256];
     chm_entry* lzxc = NULL;
     unmarshaller u;
@@ -960,6 +2238,15 @@ bool chm_parse(chm_file* h, chm_reader read_func, void* read_ctx) {
     memzero(h, sizeof(chm_file));
     h->read_func = read_func;
     h->read_ctx = read_ctx;
+    h->lazy_entries = lazy;
+
+    h->sync = (struct chm_sync*)calloc(1, sizeof(struct chm_sync));
+    if (h->sync == NULL) {
+        return false;
+    }
+    chm_mutex_init(&h->sync->lookup_mu);
+    chm_mutex_init(&h->sync->decoders_mu);
+    chm_mutex_init(&h->sync->checkpoints_mu);
 
     /* read and verify header */
     int64_t n = CHM_ITSF_V3_LEN;
@@ -996,21 +2283,16 @@ bool chm_parse(chm_file* h, chm_reader read_func, void* read_ctx) {
 
     h->compression_enabled = true;
 
-    parse_entries(h);
-    if (h->n_entries == 0) {
-        goto Error;
-    }
-
-    for (int i = 0; i < h->n_entries; i++) {
-        chm_entry* e = h->entries[i];
-        if (streq(e->path, CHMU_RESET_TABLE)) {
-            h->rt_unit = e;
-        } else if (streq(e->path, CHMU_CONTENT)) {
-            h->cn_unit = e;
-        } else if (streq(e->path, CHMU_LZXC_CONTROLDATA)) {
-            lzxc = e;
+    if (!lazy) {
+        parse_entries(h);
+        if (h->n_entries == 0) {
+            goto Error;
         }
     }
+
+    h->rt_unit = chm_find_entry(h, CHMU_RESET_TABLE);
+    h->cn_unit = chm_find_entry(h, CHMU_CONTENT);
+    lzxc = chm_find_entry(h, CHMU_LZXC_CONTROLDATA);
     if (is_null_or_compressed(h->rt_unit) || is_null_or_compressed(h->cn_unit) ||
         is_null_or_compressed(lzxc)) {
         h->compression_enabled = false;
@@ -1036,9 +2318,21 @@ bool chm_parse(chm_file* h, chm_reader read_func, void* read_ctx) {
         }
     }
     chm_set_cache_size(h, CHM_MAX_BLOCKS_CACHED);
+    if (h->cache == NULL) {
+        goto Error;
+    }
+    compute_archive_id(h);
 
     return true;
 Error:
     chm_close(h);
     return false;
 }
+
+bool chm_parse(chm_file* h, chm_reader read_func, void* read_ctx) {
+    return parse(h, read_func, read_ctx, false);
+}
+
+bool chm_parse_lazy(chm_file* h, chm_reader read_func, void* read_ctx) {
+    return parse(h, read_func, read_ctx, true);
+}
@@ -45,6 +45,7 @@
 extern "C" {
 #endif
 
+#include <stddef.h>
 #include <stdint.h>
 #include <stdbool.h>
 
@@ -79,13 +80,33 @@ typedef struct mem_reader_ctx {
 void mem_reader_init(mem_reader_ctx* ctx, void* data, int64_t size);
 int64_t mem_reader(void* ctx, void* buf, int64_t off, int64_t len);
 
+/* fd_reader uses pread() and is safe to call from multiple threads on POSIX */
 typedef struct fd_reader_ctx { int fd; } fd_reader_ctx;
 
 bool fd_reader_init(fd_reader_ctx* ctx, const char* path);
 void fd_reader_close(fd_reader_ctx* ctx);
 int64_t fd_reader(void* ctx, void* buf, int64_t off, int64_t len);
 
+/*
+mmap_reader maps the whole file into memory. Besides avoiding a syscall per read,
+it lets chm_map_entry() and chm_map_block() hand out pointers straight into the
+mapping. data and size must stay the first fields, in the same order as in mem_reader_ctx.
+*/
+typedef struct mmap_reader_ctx {
+    void* data;
+    int64_t size;
+#ifdef WIN32
+    HANDLE fh;
+    HANDLE mapping;
+#endif
+} mmap_reader_ctx;
+
+bool mmap_reader_init(mmap_reader_ctx* ctx, const char* path);
+void mmap_reader_close(mmap_reader_ctx* ctx);
+int64_t mmap_reader(void* ctx, void* buf, int64_t off, int64_t len);
+
 #ifdef WIN32
+/* win_reader is safe to call from multiple threads */
 typedef struct win_reader_ctx { HANDLE fh; } win_reader_ctx;
 
 bool win_reader_init(win_reader_ctx* ctx, const WCHAR* path);
@@ -140,7 +161,6 @@ typedef struct lzxc_reset_table {
 } lzxc_reset_table;
 
 typedef struct chm_entry {
-    struct chm_entry* next;
     char* path;
     int64_t start;
     int64_t length;
@@ -148,7 +168,18 @@ typedef struct chm_entry {
     int flags;
 } chm_entry;
 
-#define MAX_CACHE_BLOCKS 128
+/* block cache eviction policies, see chm_set_cache_budget() */
+#define CHM_CACHE_LRU 0
+#define CHM_CACHE_ARC 1
+
+typedef struct chm_cache_stats {
+    int64_t hits;
+    int64_t misses;
+    int64_t evictions;
+    int64_t bytes;  /* decompressed bytes currently cached */
+    int64_t budget; /* max bytes, the cache always holds at least one block */
+    int n_blocks;
+} chm_cache_stats;
 
 /* the structure used for chm file handles */
 typedef struct chm_file {
@@ -165,6 +196,9 @@ typedef struct chm_file {
     chm_entry* cn_unit;
 
     lzxc_reset_table reset_table;
+    /* where each compressed block starts in the content, plus compressed_len
+    at [block_count] so that block i spans [i, i+1) */
+    int64_t* block_offsets;
 
     /* LZX control data */
     bool compression_enabled;
@@ -172,36 +206,155 @@ typedef struct chm_file {
     uint32_t reset_interval;
     uint32_t reset_blkcount;
 
-    /* decompressor state */
-    struct lzx_state* lzx_state;
-    int lzx_last_block;
-    uint8_t* lzx_last_block_data;
+    /* locks and per-read decoders, see chm_retrieve_entry() */
+    struct chm_sync* sync;
+
+    /* decoder snapshots for random access, see chm_set_checkpoint_interval() */
+    struct chm_checkpoint* checkpoints;
+    int checkpoint_interval;
+    int n_checkpoints;
+    int next_checkpoint;
 
     /* cache for decompressed blocks */
-    uint8_t* cache_blocks[MAX_CACHE_BLOCKS];
-    int64_t cache_block_indices[MAX_CACHE_BLOCKS];
-    int n_cache_blocks;
+    struct chm_cache* cache;
+    /* use the process-wide cache instead, see chm_use_shared_cache() */
+    bool shared_cache;
+    /* identifies the archive's content, see chm_add_archive_id_data() */
+    uint64_t archive_id;
 
     chm_entry** entries;
     int n_entries;
+    int entries_cap;
+    /* entries and their paths are allocated from this arena */
+    struct chm_arena_chunk* entries_arena;
+    size_t entries_arena_chunk;
+    /* case-insensitive path index over entries, see chm_find_entry() */
+    chm_entry** entries_hash;
+    uint32_t entries_hash_mask;
+    /* opened with chm_parse_lazy(): entries only has what was looked up so far */
+    bool lazy_entries;
     /* might be a partial failure i.e. might still have entries */
     bool parse_entries_failed;
 } chm_file;
 
 void chm_close(struct chm_file* h);
 
+/* how many decompressed blocks should be cached. same as chm_set_cache_budget()
+with nCacheBlocks * block_len bytes and the current policy */
 void chm_set_cache_size(struct chm_file* h, int nCacheBlocks);
 
+/* cap the decompressed block cache at budget bytes and pick the eviction policy
+(CHM_CACHE_LRU or CHM_CACHE_ARC). ARC holds up better when one-off reads of big
+entries are mixed with repeated reads of small ones. */
+void chm_set_cache_budget(struct chm_file* h, int64_t budget, int policy);
+
+/* stats of the cache the handle uses: its own or the shared one */
+void chm_get_cache_stats(struct chm_file* h, chm_cache_stats* stats);
+
+/* use a process-wide block cache instead of the handle's own. Handles of the same
+archive, even opened separately, then decode each block only once between them.
+Blocks are keyed by h->archive_id, which chm_parse() derives from the header
+UUIDs and timestamp, the section sizes and the reset table. To tell apart archives
+these might not (e.g. a file rewritten in place), mix in what the caller knows
+about the file, like its size and modification time, with chm_add_archive_id_data()
+before reading. Call before sharing the handle between threads. */
+bool chm_use_shared_cache(struct chm_file* h, bool use);
+void chm_add_archive_id_data(struct chm_file* h, const void* data, size_t len);
+
+/* one budget and eviction policy for all blocks in the shared cache, 64 MB LRU by
+default. Can be called at any time */
+void chm_set_shared_cache_budget(int64_t budget, int policy);
+void chm_get_shared_cache_stats(chm_cache_stats* stats);
+
+/* reading a block that isn't the next one after the last decoded block means
+decoding every block since the start of its reset interval. With checkpoints
+enabled the decoder state is saved every nBlocks blocks into one of
+maxCheckpoints slots (reused round-robin), and a seek resumes from the nearest
+earlier checkpoint instead. Each checkpoint costs up to window_size bytes plus
+~25 kB. nBlocks or maxCheckpoints <= 0 disables checkpoints (the default). */
+bool chm_set_checkpoint_interval(struct chm_file* h, int nBlocks, int maxCheckpoints);
+
+/* LZX decoders (up to 2 MB each) are shared by all handles in the process and
+only held during a read. This caps the memory of all of them, in use or idle;
+idle ones are freed to stay under it. Defaults to about 32 MB. */
+void chm_set_lzx_pool_limit(int64_t bytes);
+
 bool chm_parse(struct chm_file* f, chm_reader read_func, void* read_ctx);
 
+/* like chm_parse() but only reads the headers. Instead of loading the whole
+directory up front, chm_find_entry() descends the PMGI index to the one PMGL
+block that can hold the path, so opening doesn't get slower with archive size.
+f->entries starts out empty and only collects the entries found so far. */
+bool chm_parse_lazy(struct chm_file* f, chm_reader read_func, void* read_ctx);
+
 /* allow intercepting debug messages from the code */
 typedef void (*dbgprintfunc)(const char* s);
 void chm_set_dbgprint(dbgprintfunc f);
 
-/* retrieve part of an entry from the archive */
+/* find an entry by its path (compared case-insensitively). returns NULL if not found */
+chm_entry* chm_find_entry(struct chm_file* h, const char* path);
+
+/* retrieve part of an entry from the archive.
+Several threads can call chm_find_entry() and chm_retrieve_entry() on the same
+handle at once, provided the reader is thread-safe too (fd_reader on POSIX,
+mmap_reader, mem_reader and win_reader are). Each call decodes with its own
+decoder and they share the block cache. Everything else, including changing
+cache or checkpoint settings and walking f->entries of a lazily parsed
+handle, must not run concurrently with them. */
 int64_t chm_retrieve_entry(struct chm_file* h, chm_entry* e, unsigned char* buf, int64_t addr,
                            int64_t len);
 
+/* called by chm_retrieve_entries() with len bytes of entries[i], starting at offset
+off in the entry. Pieces of one entry arrive in order; pieces of different entries
+may interleave. If the entry can't be read, it's called once with data == NULL and
+no more pieces of it follow. Return false to stop. */
+typedef bool (*chm_batch_cb)(void* ctx, int i, const uint8_t* data, int64_t off, int64_t len);
+
+/* read n entries in the order they're stored rather than the order given: the
+uncompressed ones by offset, then the compressed ones by position in the LZX
+stream, decoding each block they need once. Reading all entries this way decodes
+the MSCompressed section exactly once. Empty entries are skipped. Returns false if
+out of memory or cb asked to stop; failures of single entries go to cb. */
+bool chm_retrieve_entries(struct chm_file* h, chm_entry** entries, int n, chm_batch_cb cb,
+                          void* ctx);
+
+/* sequential reader over one entry. Unlike calling chm_retrieve_entry() in a loop,
+a stream keeps its decoder between reads, so each block is decoded exactly once
+and a read is mostly a memcpy. With readAhead a background thread decodes the
+next block while the caller works on the current one. A stream is used by one
+thread at a time; several streams can be open on the same handle. */
+typedef struct chm_stream chm_stream;
+
+/* NULL if e can't be read (e.g. a compressed entry in an archive without
+compression) or out of memory */
+chm_stream* chm_stream_open(struct chm_file* h, chm_entry* e, bool readAhead);
+
+/* read up to len bytes from the current position. returns the number of bytes
+read, 0 at the end of the entry or -1 on error */
+int64_t chm_stream_read(chm_stream* s, uint8_t* buf, int64_t len);
+
+void chm_stream_close(chm_stream* s);
+
+/* decompress len bytes of the MSCompressed section, starting at offset start (the
+same offsets as chm_entry.start of CHM_COMPRESSED entries), into buf. Reset
+intervals are independent LZX streams, so they are decoded in parallel on
+nThreads threads (<= 0 means one per CPU), each with its own decoder. Use
+start = 0 and len = reset_table.uncompressed_len for the whole archive.
+This doesn't use the block cache or the handle's decoder, but calls the reader
+from several threads at once: fd_reader, mmap_reader and mem_reader are fine.
+Returns the number of bytes decompressed, less than len on error. */
+int64_t chm_decompress_range(struct chm_file* h, uint8_t* buf, int64_t start, int64_t len,
+                             int nThreads);
+
+/* zero-copy access for archives opened with mmap_reader or mem_reader.
+chm_map_entry() returns a pointer to the e->length bytes of an uncompressed entry,
+chm_map_block() a pointer to the raw LZX bytes of compressed block nBlock (its size goes
+to *len). Both return NULL if the reader doesn't support mapping or the bytes are
+out of range; fall back to chm_retrieve_entry() in that case.
+Pointers stay valid until the reader is closed. */
+const uint8_t* chm_map_entry(struct chm_file* h, chm_entry* e);
+const uint8_t* chm_map_block(struct chm_file* h, int64_t nBlock, int64_t* len);
+
 #ifdef __cplusplus
 }
 #endif
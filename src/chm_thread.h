@@ -0,0 +1,184 @@
+/***************************************************************************
+ *             chm_thread.h - minimal threads and mutexes                  *
+ *                           -------------------                           *
+ *                                                                         *
+ *  notes:      Thin wrappers over pthreads and the win32 API, just enough *
+ *              for chm_lib's internal worker threads.                     *
+ ***************************************************************************/
+
+/***************************************************************************
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU Lesser General Public License as        *
+ *   published by the Free Software Foundation; either version 2.1 of the  *
+ *   License, or (at your option) any later version.                       *
+ *                                                                         *
+ ***************************************************************************/
+
+#ifndef INCLUDED_CHM_THREAD_H
+#define INCLUDED_CHM_THREAD_H
+
+#include <stdbool.h>
+
+#ifdef WIN32
+#include <windows.h>
+#else
+#include <pthread.h>
+#include <unistd.h>
+#endif
+
+typedef void (*chm_thread_func)(void* arg);
+
+typedef struct chm_thread {
+#ifdef WIN32
+    HANDLE handle;
+#else
+    pthread_t tid;
+#endif
+    chm_thread_func func;
+    void* arg;
+} chm_thread;
+
+typedef struct chm_mutex {
+#ifdef WIN32
+    SRWLOCK lock;
+#else
+    pthread_mutex_t m;
+#endif
+} chm_mutex;
+
+typedef struct chm_cond {
+#ifdef WIN32
+    CONDITION_VARIABLE cv;
+#else
+    pthread_cond_t c;
+#endif
+} chm_cond;
+
+/* for mutexes with static storage, which need no chm_mutex_init() */
+#ifdef WIN32
+#define CHM_MUTEX_INITIALIZER \
+    { SRWLOCK_INIT }
+#else
+#define CHM_MUTEX_INITIALIZER \
+    { PTHREAD_MUTEX_INITIALIZER }
+#endif
+
+#ifdef WIN32
+
+static inline DWORD WINAPI chm_thread_main(LPVOID p) {
+    chm_thread* t = (chm_thread*)p;
+    t->func(t->arg);
+    return 0;
+}
+
+/* t must stay valid until chm_thread_join() */
+static inline bool chm_thread_start(chm_thread* t, chm_thread_func func, void* arg) {
+    t->func = func;
+    t->arg = arg;
+    t->handle = CreateThread(NULL, 0, chm_thread_main, t, 0, NULL);
+    return t->handle != NULL;
+}
+
+static inline void chm_thread_join(chm_thread* t) {
+    WaitForSingleObject(t->handle, INFINITE);
+    CloseHandle(t->handle);
+}
+
+static inline void chm_mutex_init(chm_mutex* m) {
+    InitializeSRWLock(&m->lock);
+}
+
+static inline void chm_mutex_destroy(chm_mutex* m) {
+    (void)m;
+}
+
+static inline void chm_mutex_lock(chm_mutex* m) {
+    AcquireSRWLockExclusive(&m->lock);
+}
+
+static inline void chm_mutex_unlock(chm_mutex* m) {
+    ReleaseSRWLockExclusive(&m->lock);
+}
+
+static inline void chm_cond_init(chm_cond* c) {
+    InitializeConditionVariable(&c->cv);
+}
+
+static inline void chm_cond_destroy(chm_cond* c) {
+    (void)c;
+}
+
+static inline void chm_cond_wait(chm_cond* c, chm_mutex* m) {
+    SleepConditionVariableSRW(&c->cv, &m->lock, INFINITE, 0);
+}
+
+static inline void chm_cond_broadcast(chm_cond* c) {
+    WakeAllConditionVariable(&c->cv);
+}
+
+static inline int chm_cpu_count(void) {
+    SYSTEM_INFO si;
+    GetSystemInfo(&si);
+    return (int)si.dwNumberOfProcessors;
+}
+
+#else
+
+static inline void* chm_thread_main(void* p) {
+    chm_thread* t = (chm_thread*)p;
+    t->func(t->arg);
+    return NULL;
+}
+
+/* t must stay valid until chm_thread_join() */
+static inline bool chm_thread_start(chm_thread* t, chm_thread_func func, void* arg) {
+    t->func = func;
+    t->arg = arg;
+    return pthread_create(&t->tid, NULL, chm_thread_main, t) == 0;
+}
+
+static inline void chm_thread_join(chm_thread* t) {
+    pthread_join(t->tid, NULL);
+}
+
+static inline void chm_mutex_init(chm_mutex* m) {
+    pthread_mutex_init(&m->m, NULL);
+}
+
+static inline void chm_mutex_destroy(chm_mutex* m) {
+    pthread_mutex_destroy(&m->m);
+}
+
+static inline void chm_mutex_lock(chm_mutex* m) {
+    pthread_mutex_lock(&m->m);
+}
+
+static inline void chm_mutex_unlock(chm_mutex* m) {
+    pthread_mutex_unlock(&m->m);
+}
+
+static inline void chm_cond_init(chm_cond* c) {
+    pthread_cond_init(&c->c, NULL);
+}
+
+static inline void chm_cond_destroy(chm_cond* c) {
+    pthread_cond_destroy(&c->c);
+}
+
+static inline void chm_cond_wait(chm_cond* c, chm_mutex* m) {
+    pthread_cond_wait(&c->c, &m->m);
+}
+
+static inline void chm_cond_broadcast(chm_cond* c) {
+    pthread_cond_broadcast(&c->c);
+}
+
+static inline int chm_cpu_count(void) {
+    long n = sysconf(_SC_NPROCESSORS_ONLN);
+    return n > 0 ? (int)n : 1;
+}
+
+#endif
+
+#endif /* INCLUDED_CHM_THREAD_H */
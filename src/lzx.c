@@ -34,6 +34,19 @@
 #include <string.h>
 #include <stdint.h>
 
+#if defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#define LZX_SSE2 1
+#elif defined(__ARM_NEON) || defined(_M_ARM64)
+#include <arm_neon.h>
+#define LZX_NEON 1
+#endif
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+
 /* some constants defined by the LZX specification */
 #define LZX_MIN_MATCH 2
 /* #define LZX_MAX_MATCH 257 */
@@ -47,20 +60,66 @@
 #define LZX_NUM_PRIMARY_LENGTHS 7     /* this one missing from spec! */
 #define LZX_NUM_SECONDARY_LENGTHS 249 /* length tree #elements */
 
-/* LZX huffman defines: tweak tablebits as desired */
+/* LZX huffman defines: tweak tablebits as desired, at build time with e.g.
+ * -DLZX_MAINTREE_TABLEBITS=10. MAXLEN is the longest code length the tree's
+ * code lengths can express. Codes longer than TABLEBITS are resolved with
+ * one more lookup in a second-level table */
 #define LZX_PRETREE_MAXSYMBOLS LZX_PRETREE_NUM_ELEMENTS
+#define LZX_PRETREE_MAXLEN 15
+#ifndef LZX_PRETREE_TABLEBITS
 #define LZX_PRETREE_TABLEBITS 6
+#endif
 #define LZX_MAINTREE_MAXSYMBOLS (LZX_NUM_CHARS + 50 * 8)
+#define LZX_MAINTREE_MAXLEN 16
+#ifndef LZX_MAINTREE_TABLEBITS
 #define LZX_MAINTREE_TABLEBITS 12
+#endif
 #define LZX_LENGTH_MAXSYMBOLS (LZX_NUM_SECONDARY_LENGTHS + 1)
+#define LZX_LENGTH_MAXLEN 16
+#ifndef LZX_LENGTH_TABLEBITS
 #define LZX_LENGTH_TABLEBITS 12
+#endif
 #define LZX_ALIGNED_MAXSYMBOLS LZX_ALIGNED_NUM_ELEMENTS
+#define LZX_ALIGNED_MAXLEN 7
+#ifndef LZX_ALIGNED_TABLEBITS
 #define LZX_ALIGNED_TABLEBITS 7
+#endif
+
+/* decode literal pairs with one lookup, see build_pair_table(). Off by
+ * default until it has been measured on real CHM content; it is most likely
+ * to help on text-heavy files */
+#ifndef LZX_MULTI_LITERAL
+#define LZX_MULTI_LITERAL 0
+#endif
 
 #define LZX_LENTABLE_SAFETY 64 /* we allow length table decoding overruns */
 
-#define LZX_DECLARE_TABLE(tbl)                                                          \
-    uint16_t tbl##_table[(1 << LZX_##tbl##_TABLEBITS) + (LZX_##tbl##_MAXSYMBOLS << 1)]; \
+/* decode table entries are either symbol | code length << 10, or
+ * HUFF_SUBTABLE | offset of a second-level table of 1 << (MAXLEN - TABLEBITS)
+ * entries. A complete code has at most MAXSYMBOLS/2 prefixes that need one */
+#define HUFF_SYMBITS 10
+#define HUFF_SYMMASK ((1 << HUFF_SYMBITS) - 1)
+#define HUFF_SUBTABLE 0x8000
+
+#define LZX_TABLE_SIZE(tbl)       \
+    ((1 << LZX_##tbl##_TABLEBITS) + \
+     ((LZX_##tbl##_MAXSYMBOLS / 2) << (LZX_##tbl##_MAXLEN - LZX_##tbl##_TABLEBITS)))
+
+/* second-level offsets must fit in the 15 bits below HUFF_SUBTABLE, which
+ * limits how small TABLEBITS can be made. fails to compile if they don't */
+#define LZX_CHECK_TABLE(tbl)                                                  \
+    typedef char lzx_check_##tbl##_table                                      \
+        [(LZX_##tbl##_TABLEBITS <= LZX_##tbl##_MAXLEN &&                      \
+          LZX_TABLE_SIZE(tbl) <= HUFF_SUBTABLE &&                             \
+          LZX_##tbl##_MAXSYMBOLS <= (1 << HUFF_SYMBITS)) ? 1 : -1]
+
+LZX_CHECK_TABLE(PRETREE);
+LZX_CHECK_TABLE(MAINTREE);
+LZX_CHECK_TABLE(LENGTH);
+LZX_CHECK_TABLE(ALIGNED);
+
+#define LZX_DECLARE_TABLE(tbl)                   \
+    uint16_t tbl##_table[LZX_TABLE_SIZE(tbl)];   \
     uint8_t tbl##_len[LZX_##tbl##_MAXSYMBOLS + LZX_LENTABLE_SAFETY]
 
 struct lzx_state {
@@ -68,6 +127,7 @@ struct lzx_state {
     uint32_t window_size;     /* window size (32Kb through 2Mb)          */
     uint32_t actual_size;     /* window size when it was first allocated */
     uint32_t window_posn;     /* current offset within the window        */
+    uint32_t window_used;     /* bytes of window written since reset     */
     uint32_t R0, R1, R2;      /* for the LRU offset system               */
     uint16_t main_elements;   /* number of main tree elements            */
     int header_read;          /* have we started decoding at all yet?    */
@@ -83,6 +143,9 @@ struct lzx_state {
     LZX_DECLARE_TABLE(MAINTREE);
     LZX_DECLARE_TABLE(LENGTH);
     LZX_DECLARE_TABLE(ALIGNED);
+#if LZX_MULTI_LITERAL
+    uint32_t MAINTREE_pair[1 << LZX_MAINTREE_TABLEBITS];
+#endif
 };
 
 /* LZX decruncher */
@@ -163,7 +226,8 @@ struct lzx_state* lzx_init(int window) {
 
     /* allocate state and associated window */
     pState = (struct lzx_state*)malloc(sizeof(struct lzx_state));
-    if (!pState || !(pState->window = (uint8_t*)malloc(wndsize))) {
+    /* zeroed, so it never holds what freed memory held before */
+    if (!pState || !(pState->window = (uint8_t*)calloc(1, wndsize))) {
         free(pState);
         return NULL;
     }
@@ -191,6 +255,7 @@ struct lzx_state* lzx_init(int window) {
     pState->intel_curpos = 0;
     pState->intel_started = 0;
     pState->window_posn = 0;
+    pState->window_used = 0;
 
     /* initialise tables to 0 (because deltas will be applied to them) */
     for (i = 0; i < LZX_MAINTREE_MAXSYMBOLS; i++)
@@ -201,6 +266,10 @@ struct lzx_state* lzx_init(int window) {
     return pState;
 }
 
+size_t lzx_state_size(const struct lzx_state* pState) {
+    return sizeof(struct lzx_state) + pState->actual_size;
+}
+
 void lzx_teardown(struct lzx_state* pState) {
     if (pState) {
         if (pState->window)
@@ -220,6 +289,7 @@ void lzx_reset(struct lzx_state* pState) {
     pState->intel_curpos = 0;
     pState->intel_started = 0;
     pState->window_posn = 0;
+    pState->window_used = 0;
 
     for (i = 0; i < LZX_MAINTREE_MAXSYMBOLS + LZX_LENTABLE_SAFETY; i++) {
         pState->MAINTREE_len[i] = 0;
@@ -230,6 +300,50 @@ void lzx_reset(struct lzx_state* pState) {
     }
 }
 
+void lzx_clear_window(struct lzx_state* pState) {
+    memset(pState->window, 0, pState->actual_size);
+}
+
+struct lzx_snapshot {
+    size_t capacity; /* bytes allocated for window */
+    struct lzx_state state;
+    uint8_t window[];
+};
+
+/* until the window wraps around for the first time only window[0, window_used)
+ * is ever referenced, so that's all a snapshot needs to keep */
+struct lzx_snapshot* lzx_snapshot(struct lzx_state* pState, struct lzx_snapshot* snap) {
+    size_t used = pState->window_used;
+    if (snap == NULL || snap->capacity < used) {
+        free(snap);
+        snap = (struct lzx_snapshot*)malloc(sizeof(struct lzx_snapshot) + used);
+        if (!snap)
+            return NULL;
+        snap->capacity = used;
+    }
+    memcpy(&snap->state, pState, sizeof(struct lzx_state));
+    memcpy(snap->window, pState->window, used);
+    return snap;
+}
+
+void lzx_restore(struct lzx_state* pState, const struct lzx_snapshot* snap) {
+    uint8_t* window = pState->window;
+    uint32_t actual_size = pState->actual_size;
+
+    memcpy(pState, &snap->state, sizeof(struct lzx_state));
+    pState->window = window;
+    pState->actual_size = actual_size;
+    memcpy(window, snap->window, snap->state.window_used);
+}
+
+size_t lzx_snapshot_size(const struct lzx_snapshot* snap) {
+    return sizeof(struct lzx_snapshot) + snap->capacity;
+}
+
+void lzx_snapshot_free(struct lzx_snapshot* snap) {
+    free(snap);
+}
+
 /* Bitstream reading macros:
  *
  * INIT_BITSTREAM    should be used first to set up the system
@@ -241,17 +355,17 @@ void lzx_reset(struct lzx_state* pState) {
  *
  * These bit access routines work by using the area beyond the MSB and the
  * LSB as a free source of zeroes. This avoids having to mask any bits.
- * So we have to know the bit width of the bitbuffer variable. This is
- * sizeof(uint32_t) * 8, also defined as uint32_t_BITS
+ * So we have to know the bit width of the bitbuffer variable, BITBUF_WIDTH.
+ *
+ * The bitstream is a sequence of little-endian 16-bit words. N is never more
+ * than 17, so when a refill is needed there are at most 16 bits left and
+ * three words (48 bits) always fit. Near the end of the input, words are
+ * added one at a time and words past endinp read as zeroes. inpos still
+ * advances past endinp in that case, which is what the buffer exhaustion
+ * check looks at.
  */
 
-/* number of bits in uint32_t. Note: This must be at multiple of 16, and at
- * least 32 for the bitbuffer code to work (ie, it must be able to ensure
- * up to 17 bits - that's adding 16 bits when there's one bit left, or
- * adding 32 bits when there are no bits left. The code should work fine
- * for machines where uint32_t >= 32 bits.
- */
-#define uint32_t_BITS (sizeof(uint32_t) << 3)
+#define BITBUF_WIDTH 64
 
 #define INIT_BITSTREAM \
     do {               \
@@ -259,14 +373,27 @@ void lzx_reset(struct lzx_state* pState) {
         bitbuf = 0;    \
     } while (0)
 
-#define ENSURE_BITS(n)                                                             \
-    while (bitsleft < (n)) {                                                       \
-        bitbuf |= ((inpos[1] << 8) | inpos[0]) << (uint32_t_BITS - 16 - bitsleft); \
-        bitsleft += 16;                                                            \
-        inpos += 2;                                                                \
+#define READ_WORD(p) ((uint32_t)(p)[0] | ((uint32_t)(p)[1] << 8))
+
+#define ENSURE_BITS(n)                                                                  \
+    if (bitsleft < (n)) {                                                               \
+        if (endinp - inpos >= 6) {                                                      \
+            bitbuf |= (((uint64_t)READ_WORD(inpos) << 32) |                             \
+                       ((uint64_t)READ_WORD(inpos + 2) << 16) | READ_WORD(inpos + 4))   \
+                      << (16 - bitsleft);                                               \
+            bitsleft += 48;                                                             \
+            inpos += 6;                                                                 \
+        } else {                                                                        \
+            do {                                                                        \
+                uint32_t w_ = (endinp - inpos >= 2) ? READ_WORD(inpos) : 0;             \
+                bitbuf |= (uint64_t)w_ << (BITBUF_WIDTH - 16 - bitsleft);               \
+                bitsleft += 16;                                                         \
+                inpos += 2;                                                             \
+            } while (bitsleft < (n));                                                   \
+        }                                                                               \
     }
 
-#define PEEK_BITS(n) (bitbuf >> (uint32_t_BITS - (n)))
+#define PEEK_BITS(n) ((uint32_t)(bitbuf >> (BITBUF_WIDTH - (n))))
 #define REMOVE_BITS(n) ((bitbuf <<= (n)), (bitsleft -= (n)))
 
 #define READ_BITS(v, n)     \
@@ -279,6 +406,7 @@ void lzx_reset(struct lzx_state* pState) {
 /* Huffman macros */
 
 #define TABLEBITS(tbl) (LZX_##tbl##_TABLEBITS)
+#define MAXLEN(tbl) (LZX_##tbl##_MAXLEN)
 #define MAXSYMBOLS(tbl) (LZX_##tbl##_MAXSYMBOLS)
 #define SYMTABLE(tbl) (pState->tbl##_table)
 #define LENTABLE(tbl) (pState->tbl##_len)
@@ -289,30 +417,25 @@ void lzx_reset(struct lzx_state* pState) {
  * writing each call out in full by hand.
  */
 #define BUILD_TABLE(tbl)                                                                    \
-    if (make_decode_table(MAXSYMBOLS(tbl), TABLEBITS(tbl), LENTABLE(tbl), SYMTABLE(tbl))) { \
-        return DECR_ILLEGALDATA;                                                            \
+    if (make_decode_table(MAXSYMBOLS(tbl), TABLEBITS(tbl), MAXLEN(tbl), LENTABLE(tbl), \
+                          SYMTABLE(tbl), LZX_TABLE_SIZE(tbl))) {                       \
+        return DECR_ILLEGALDATA;                                                       \
     }
 
 /* READ_HUFFSYM(tablename, var) decodes one huffman symbol from the
  * bitstream using the stated table and puts it in var.
  */
-#define READ_HUFFSYM(tbl, var)                                             \
-    do {                                                                   \
-        ENSURE_BITS(16);                                                   \
-        hufftbl = SYMTABLE(tbl);                                           \
-        if ((i = hufftbl[PEEK_BITS(TABLEBITS(tbl))]) >= MAXSYMBOLS(tbl)) { \
-            j = 1 << (uint32_t_BITS - TABLEBITS(tbl));                     \
-            do {                                                           \
-                j >>= 1;                                                   \
-                i <<= 1;                                                   \
-                i |= (bitbuf & j) ? 1 : 0;                                 \
-                if (!j) {                                                  \
-                    return DECR_ILLEGALDATA;                               \
-                }                                                          \
-            } while ((i = hufftbl[i]) >= MAXSYMBOLS(tbl));                 \
-        }                                                                  \
-        j = LENTABLE(tbl)[(var) = i];                                      \
-        REMOVE_BITS(j);                                                    \
+#define READ_HUFFSYM(tbl, var)                                                            \
+    do {                                                                                  \
+        ENSURE_BITS(16);                                                                  \
+        hufftbl = SYMTABLE(tbl);                                                          \
+        i = hufftbl[PEEK_BITS(TABLEBITS(tbl))];                                           \
+        if (i & HUFF_SUBTABLE) {                                                          \
+            i = hufftbl[(i & ~HUFF_SUBTABLE) +                                            \
+                        (PEEK_BITS(MAXLEN(tbl)) & ((1 << (MAXLEN(tbl) - TABLEBITS(tbl))) - 1))]; \
+        }                                                                                 \
+        (var) = i & HUFF_SYMMASK;                                                         \
+        REMOVE_BITS(i >> HUFF_SYMBITS);                                                   \
     } while (0)
 
 /* READ_LENGTHS(tablename, first, last) reads in code lengths for symbols
@@ -324,7 +447,7 @@ void lzx_reset(struct lzx_state* pState) {
         lb.bb = bitbuf;                                                   \
         lb.bl = bitsleft;                                                 \
         lb.ip = inpos;                                                    \
-        if (lzx_read_lens(pState, LENTABLE(tbl), (first), (last), &lb)) { \
+        if (lzx_read_lens(pState, LENTABLE(tbl), (first), (last), &lb, endinp)) { \
             return DECR_ILLEGALDATA;                                      \
         }                                                                 \
         bitbuf = lb.bb;                                                   \
@@ -332,114 +455,155 @@ void lzx_reset(struct lzx_state* pState) {
         inpos = lb.ip;                                                    \
     } while (0)
 
-/* make_decode_table(nsyms, nbits, length[], table[])
+/* make_decode_table(nsyms, nbits, maxlen, length[], table[], size)
  *
- * This function was coded by David Tritscher. It builds a fast huffman
- * decoding table out of just a canonical huffman code lengths table.
+ * Builds a two-level huffman decoding table out of a canonical huffman
+ * code lengths table. The first nbits of the input index the first level.
+ * Codes of nbits or less are found there directly, the entries of longer
+ * codes point at a second-level table indexed by the next maxlen - nbits
+ * bits.
  *
  * nsyms  = total number of symbols in this huffman tree.
  * nbits  = any symbols with a code length of nbits or less can be decoded
  *          in one lookup of the table.
+ * maxlen = longest possible code length.
  * length = A table to get code lengths from [0 to syms-1]
  * table  = The table to fill up with decoded symbols and pointers.
+ * size   = number of entries in table.
  *
  * Returns 0 for OK or 1 for error
  */
-static int make_decode_table(uint32_t nsyms, uint32_t nbits, uint8_t* length, uint16_t* table) {
-    uint16_t sym;
-    uint32_t leaf;
-    uint8_t bit_num = 1;
-    uint32_t fill;
-    uint32_t pos = 0; /* the current position in the decode table */
-    uint32_t table_mask = 1 << nbits;
-    uint32_t bit_mask = table_mask >> 1; /* don't do 0 length codes */
-    uint32_t next_symbol = bit_mask;     /* base of allocation for long codes */
-
-    /* fill entries for codes short enough for a direct mapping */
-    while (bit_num <= nbits) {
-        for (sym = 0; sym < nsyms; sym++) {
-            if (length[sym] != bit_num) {
-                continue;
-            }
-            leaf = pos;
+static int make_decode_table(uint32_t nsyms, uint32_t nbits, uint32_t maxlen, uint8_t* length,
+                             uint16_t* table, uint32_t size) {
+    uint32_t sym, bit_num, fill;
+    uint32_t subbits = maxlen - nbits;
+    uint32_t next_sub = 1 << nbits; /* where the next second-level table goes */
+    uint32_t table_mask = 1 << maxlen;
+    uint32_t count[17] = {0};
+    uint32_t next_code[17]; /* per length, left-aligned to maxlen bits */
+    uint32_t pos = 0;
 
-            if ((pos += bit_mask) > table_mask)
-                return 1; /* table overrun */
-
-            /* fill all possible lookups of this symbol with the symbol itself */
-            fill = bit_mask;
-            while (fill-- > 0) {
-                table[leaf++] = sym;
-            }
-        }
-        bit_mask >>= 1;
-        bit_num++;
+    for (sym = 0; sym < nsyms; sym++) {
+        if (length[sym] > maxlen)
+            return 1;
+        count[length[sym]]++;
+    }
+    /* canonical codes: shorter codes first, same length in symbol order */
+    for (bit_num = 1; bit_num <= maxlen; bit_num++) {
+        next_code[bit_num] = pos;
+        pos += count[bit_num] << (maxlen - bit_num);
+        if (pos > table_mask)
+            return 1; /* table overrun */
     }
-
-    /* if there are any codes longer than nbits */
     if (pos != table_mask) {
-        /* clear the remainder of the table */
-        for (sym = pos; sym < table_mask; sym++) {
-            table[sym] = 0;
-        }
-
-        /* give ourselves room for codes to grow by up to 16 more bits */
-        pos <<= 16;
-        table_mask <<= 16;
-        bit_mask = 1 << 15;
+        /* either erroneous table, or all elements are 0. a tree without codes
+         * is fine as long as it's not used, but if corrupt input uses it
+         * anyway it must decode symbol 0 rather than follow subtable links
+         * left in the table from before */
+        if (pos != 0)
+            return 1;
+        memset(table, 0, sizeof(uint16_t) << nbits);
+        return 0;
+    }
 
-        while (bit_num <= 16) {
-            for (sym = 0; sym < nsyms; sym++) {
-                if (length[sym] != bit_num) {
-                    continue;
-                }
-                leaf = pos >> 16;
-                for (fill = 0; fill < bit_num - nbits; fill++) {
-                    /* if this path hasn't been taken yet, 'allocate' two entries */
-                    if (table[leaf] == 0) {
-                        table[(next_symbol << 1)] = 0;
-                        table[(next_symbol << 1) + 1] = 0;
-                        table[leaf] = next_symbol++;
-                    }
-                    /* follow the path and select either left or right for next bit */
-                    leaf = table[leaf] << 1;
-                    if ((pos >> (15 - fill)) & 1)
-                        leaf++;
-                }
-                table[leaf] = sym;
+    memset(table, 0, sizeof(uint16_t) << nbits);
+    for (sym = 0; sym < nsyms; sym++) {
+        bit_num = length[sym];
+        if (bit_num == 0) {
+            continue;
+        }
+        pos = next_code[bit_num];
+        next_code[bit_num] += 1 << (maxlen - bit_num);
 
-                if ((pos += bit_mask) > table_mask)
-                    return 1; /* table overflow */
+        uint16_t entry = (uint16_t)(sym | (bit_num << HUFF_SYMBITS));
+        uint16_t* dst;
+        if (bit_num <= nbits) {
+            /* fill all possible lookups of this symbol with the symbol itself */
+            dst = table + (pos >> subbits);
+            fill = 1 << (nbits - bit_num);
+        } else {
+            uint16_t* first = table + (pos >> subbits);
+            if (!(*first & HUFF_SUBTABLE)) {
+                if (next_sub + (1 << subbits) > size)
+                    return 1;
+                *first = (uint16_t)(HUFF_SUBTABLE | next_sub);
+                memset(table + next_sub, 0, sizeof(uint16_t) << subbits);
+                next_sub += 1 << subbits;
             }
-            bit_mask >>= 1;
-            bit_num++;
+            dst = table + (*first & ~HUFF_SUBTABLE) + (pos & ((1 << subbits) - 1));
+            fill = 1 << (maxlen - bit_num);
+        }
+        while (fill-- > 0) {
+            *dst++ = entry;
         }
     }
+    return 0;
+}
 
-    /* full table? */
-    if (pos == table_mask)
-        return 0;
-
-    /* either erroneous table, or all elements are 0 - let's find out. */
-    for (sym = 0; sym < nsyms; sym++) {
-        if (length[sym])
-            return 1;
+#if LZX_MULTI_LITERAL
+/* For every first-level index of the main tree that starts with a literal
+ * code, store that literal and, if the rest of the index also holds a
+ * complete literal code, the second literal too. Entries are lit1 |
+ * lit2 << 8 | total code length << 16 | number of literals << 24, or 0 if
+ * the index doesn't start with a literal.
+ * Single literals go through this table too, so the decoding loop branches
+ * on literal vs. anything else, just like it does without the table */
+static void build_pair_table(struct lzx_state* pState) {
+    const uint32_t nbits = LZX_MAINTREE_TABLEBITS;
+    const uint32_t mask = (1 << nbits) - 1;
+    uint16_t* table = pState->MAINTREE_table;
+
+    for (uint32_t idx = 0; idx <= mask; idx++) {
+        uint32_t e1 = table[idx], e2, len1, len2;
+        pState->MAINTREE_pair[idx] = 0;
+        if ((e1 & HUFF_SUBTABLE) || (e1 & HUFF_SYMMASK) >= LZX_NUM_CHARS)
+            continue;
+        len1 = e1 >> HUFF_SYMBITS;
+        if (len1 == 0)
+            continue;
+        pState->MAINTREE_pair[idx] = (e1 & 0xFF) | (len1 << 16) | (1 << 24);
+        if (len1 >= nbits)
+            continue;
+        e2 = table[(idx << len1) & mask];
+        len2 = e2 >> HUFF_SYMBITS;
+        if ((e2 & HUFF_SUBTABLE) || (e2 & HUFF_SYMMASK) >= LZX_NUM_CHARS || len2 == 0 ||
+            len2 > nbits - len1)
+            continue;
+        pState->MAINTREE_pair[idx] =
+            (e1 & 0xFF) | ((e2 & 0xFF) << 8) | ((len1 + len2) << 16) | (2 << 24);
     }
-    return 0;
 }
 
+/* output one or two literals if the next bits start with a literal code. The
+ * second byte is always written, that's fine as long as the run has room for
+ * it: if only one literal was decoded it gets overwritten next */
+#define READ_LITERAL_PAIR()                                       \
+    ENSURE_BITS(16);                                              \
+    k = pState->MAINTREE_pair[PEEK_BITS(LZX_MAINTREE_TABLEBITS)]; \
+    if (k != 0 && this_run >= 2) {                                \
+        window[window_posn] = (uint8_t)k;                         \
+        window[window_posn + 1] = (uint8_t)(k >> 8);              \
+        REMOVE_BITS((k >> 16) & 0xFF);                            \
+        window_posn += k >> 24;                                   \
+        this_run -= (int)(k >> 24);                               \
+        continue;                                                 \
+    }
+#else
+#define READ_LITERAL_PAIR()
+#endif
+
 struct lzx_bits {
-    uint32_t bb;
+    uint64_t bb;
     int bl;
     uint8_t* ip;
 };
 
 static int lzx_read_lens(struct lzx_state* pState, uint8_t* lens, uint32_t first, uint32_t last,
-                         struct lzx_bits* lb) {
-    uint32_t i, j, x, y;
+                         struct lzx_bits* lb, uint8_t* endinp) {
+    uint32_t i, x, y;
     int z;
 
-    uint32_t bitbuf = lb->bb;
+    uint64_t bitbuf = lb->bb;
     int bitsleft = lb->bl;
     uint8_t* inpos = lb->ip;
     uint16_t* hufftbl;
@@ -485,11 +649,112 @@ static int lzx_read_lens(struct lzx_state* pState, uint8_t* lens, uint32_t first
     return 0;
 }
 
+/* Match copying. A match may overlap its own output (offset < length), in
+ * which case it repeats the last offset bytes. Nothing past dst + len is ever
+ * written: the window beyond the current position still holds data from the
+ * previous pass that later matches can refer to */
+
+/* copy 16 bytes, src and dst must be at least 16 bytes apart */
+static inline void copy16(uint8_t* dst, const uint8_t* src) {
+#if defined(__AVX2__) || defined(LZX_SSE2)
+    _mm_storeu_si128((__m128i*)dst, _mm_loadu_si128((const __m128i*)src));
+#elif defined(LZX_NEON)
+    vst1q_u8(dst, vld1q_u8(src));
+#else
+    memcpy(dst, src, 16);
+#endif
+}
+
+/* copy len bytes from dst - offset to dst, within the window */
+static inline void copy_match(uint8_t* dst, uint32_t offset, uint32_t len) {
+    const uint8_t* src = dst - offset;
+
+    if (offset >= 16) {
+#if defined(__AVX2__)
+        if (offset >= 32) {
+            for (; len >= 32; len -= 32, src += 32, dst += 32)
+                _mm256_storeu_si256((__m256i*)dst, _mm256_loadu_si256((const __m256i*)src));
+        }
+#endif
+        for (; len >= 16; len -= 16, src += 16, dst += 16)
+            copy16(dst, src);
+        memcpy(dst, src, len);
+    } else if (offset == 1) {
+        memset(dst, *src, len);
+    } else {
+        /* each copy doubles the repeated pattern, so the next one can be
+         * twice as long and still not overlap */
+        while (len > offset) {
+            memcpy(dst, src, offset);
+            dst += offset;
+            len -= offset;
+            offset <<= 1;
+        }
+        memcpy(dst, src, len);
+    }
+}
+
+/* copy a match that ends at or before the end of the window, with its
+ * source possibly wrapping around to the end of the window */
+static inline void copy_window_match(uint8_t* window, uint32_t window_size, uint32_t window_posn,
+                                     uint32_t offset, uint32_t len) {
+    uint8_t* dst = window + window_posn;
+    if (offset > window_posn) {
+        /* the source starts near the end of the window, which may overlap
+         * the destination if offset is close to window_size */
+        uint32_t wrapped = offset - window_posn;
+        if (wrapped > len)
+            wrapped = len;
+        memmove(dst, dst + window_size - offset, wrapped);
+        dst += wrapped;
+        len -= wrapped;
+        /* the rest is read from the start of the window, still offset bytes back */
+    }
+    if (len > 0)
+        copy_match(dst, offset, len);
+}
+
+/* E8 translation. Most of the output is text with few, if any, 0xE8 bytes,
+ * so they're searched for 16 or 32 bytes at a time */
+
+static inline int lowest_bit_set(uint32_t x) {
+#ifdef _MSC_VER
+    unsigned long i;
+    _BitScanForward(&i, x);
+    return (int)i;
+#else
+    return __builtin_ctz(x);
+#endif
+}
+
+/* returns the first 0xE8 byte in [p, end) or NULL */
+static inline uint8_t* find_e8(uint8_t* p, uint8_t* end) {
+#if defined(__AVX2__)
+    const __m256i e8 = _mm256_set1_epi8((char)0xE8);
+    for (; end - p >= 32; p += 32) {
+        uint32_t mask = (uint32_t)_mm256_movemask_epi8(
+            _mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i*)p), e8));
+        if (mask != 0)
+            return p + lowest_bit_set(mask);
+    }
+#elif defined(LZX_SSE2)
+    const __m128i e8 = _mm_set1_epi8((char)0xE8);
+    for (; end - p >= 16; p += 16) {
+        uint32_t mask =
+            (uint32_t)_mm_movemask_epi8(_mm_cmpeq_epi8(_mm_loadu_si128((const __m128i*)p), e8));
+        if (mask != 0)
+            return p + lowest_bit_set(mask);
+    }
+#endif
+    if (p >= end)
+        return NULL;
+    return (uint8_t*)memchr(p, 0xE8, (size_t)(end - p));
+}
+
 int lzx_decompress(struct lzx_state* pState, unsigned char* inpos, unsigned char* outpos, int inlen,
                    int outlen) {
     uint8_t* endinp = inpos + inlen;
     uint8_t* window = pState->window;
-    uint8_t* runsrc, *rundest;
     uint16_t* hufftbl; /* used in READ_HUFFSYM macro as chosen decoding table */
 
     uint32_t window_posn = pState->window_posn;
@@ -498,12 +763,13 @@ int lzx_decompress(struct lzx_state* pState, unsigned char* inpos, unsigned char
     uint32_t R1 = pState->R1;
     uint32_t R2 = pState->R2;
 
-    uint32_t bitbuf;
+    uint64_t bitbuf;
     int bitsleft;
-    uint32_t match_offset, i, j, k; /* ijk used in READ_HUFFSYM macro */
+    uint32_t match_offset, i, j, k; /* i used in READ_HUFFSYM, k in READ_LITERAL_PAIR */
     struct lzx_bits lb;             /* used in READ_LENGTHS macro */
 
     int togo = outlen, this_run, main_element, aligned_bits;
+    int wrapped = pState->window_used >= pState->window_size; /* see window_used */
     int match_length, length_footer, extra, verbatim_bits;
 
     INIT_BITSTREAM;
@@ -548,6 +814,9 @@ int lzx_decompress(struct lzx_state* pState, unsigned char* inpos, unsigned char
                     READ_LENGTHS(MAINTREE, 0, 256);
                     READ_LENGTHS(MAINTREE, 256, pState->main_elements);
                     BUILD_TABLE(MAINTREE);
+#if LZX_MULTI_LITERAL
+                    build_pair_table(pState);
+#endif
                     if (LENTABLE(MAINTREE)[0xE8] != 0)
                         pState->intel_started = 1;
 
@@ -558,13 +827,16 @@ int lzx_decompress(struct lzx_state* pState, unsigned char* inpos, unsigned char
                 case LZX_BLOCKTYPE_UNCOMPRESSED:
                     pState->intel_started = 1; /* because we can't assume otherwise */
                     ENSURE_BITS(16);           /* get up to 16 pad bits into the buffer */
-                    if (bitsleft > 16)
-                        inpos -= 2; /* and align the bitstream! */
-                    R0 = inpos[0] | (inpos[1] << 8) | (inpos[2] << 16) | (inpos[3] << 24);
+                    /* the rest of the current word is padding, a whole word if it's
+                     * aligned already. give back the words read ahead of it */
+                    inpos -= ((bitsleft - 1) >> 4) << 1;
+                    if (inpos + 12 > endinp)
+                        return DECR_ILLEGALDATA;
+                    R0 = READ_WORD(inpos) | (READ_WORD(inpos + 2) << 16);
                     inpos += 4;
-                    R1 = inpos[0] | (inpos[1] << 8) | (inpos[2] << 16) | (inpos[3] << 24);
+                    R1 = READ_WORD(inpos) | (READ_WORD(inpos + 2) << 16);
                     inpos += 4;
-                    R2 = inpos[0] | (inpos[1] << 8) | (inpos[2] << 16) | (inpos[3] << 24);
+                    R2 = READ_WORD(inpos) | (READ_WORD(inpos + 2) << 16);
                     inpos += 4;
                     break;
 
@@ -579,11 +851,11 @@ int lzx_decompress(struct lzx_state* pState, unsigned char* inpos, unsigned char
              * 16 bits in size. In this case, the READ_HUFFSYM() macro used
              * in building the tables will exhaust the buffer, so we should
              * allow for this, but not allow those accidentally read bits to
-             * be used (so we check that there are at least 16 bits
-             * remaining - in this boundary case they aren't really part of
+             * be used (so we check that the words past endinp are still
+             * entirely in the bit buffer - then they aren't really part of
              * the compressed data)
              */
-            if (inpos > (endinp + 2) || bitsleft < 16)
+            if (inpos - ((bitsleft >> 4) << 1) > endinp)
                 return DECR_ILLEGALDATA;
         }
 
@@ -594,6 +866,8 @@ int lzx_decompress(struct lzx_state* pState, unsigned char* inpos, unsigned char
             pState->block_remaining -= this_run;
 
             /* apply 2^x-1 mask */
+            if (window_posn == window_size)
+                wrapped = 1;
             window_posn &= window_size - 1;
             /* runs can't straddle the window wraparound */
             if ((window_posn + this_run) > window_size)
@@ -602,6 +876,7 @@ int lzx_decompress(struct lzx_state* pState, unsigned char* inpos, unsigned char
             switch (pState->block_type) {
                 case LZX_BLOCKTYPE_VERBATIM:
                     while (this_run > 0) {
+                        READ_LITERAL_PAIR();
                         READ_HUFFSYM(MAINTREE, main_element);
 
                         if (main_element < LZX_NUM_CHARS) {
@@ -647,27 +922,26 @@ int lzx_decompress(struct lzx_state* pState, unsigned char* inpos, unsigned char
                                 R0 = match_offset;
                             }
 
-                            rundest = window + window_posn;
-                            runsrc = rundest - match_offset;
-                            window_posn += match_length;
-                            if (window_posn > window_size)
+                            /* an offset of 0 can come from R0-R2 of an
+                             * uncompressed block header. until the window
+                             * wraps, matches can only refer to what was
+                             * decoded since the last reset: the rest of the
+                             * window may be left from another archive */
+                            if (match_offset == 0 ||
+                                match_offset > (wrapped ? window_size : window_posn) ||
+                                window_posn + (uint32_t)match_length > window_size)
                                 return DECR_ILLEGALDATA;
+                            copy_window_match(window, window_size, window_posn, match_offset,
+                                              (uint32_t)match_length);
+                            window_posn += (uint32_t)match_length;
                             this_run -= match_length;
-
-                            /* copy any wrapped around source data */
-                            while ((runsrc < window) && (match_length-- > 0)) {
-                                *rundest++ = *(runsrc + window_size);
-                                runsrc++;
-                            }
-                            /* copy match data - no worries about destination wraps */
-                            while (match_length-- > 0)
-                                *rundest++ = *runsrc++;
                         }
                     }
                     break;
 
                 case LZX_BLOCKTYPE_ALIGNED:
                     while (this_run > 0) {
+                        READ_LITERAL_PAIR();
                         READ_HUFFSYM(MAINTREE, main_element);
 
                         if (main_element < LZX_NUM_CHARS) {
@@ -727,21 +1001,19 @@ int lzx_decompress(struct lzx_state* pState, unsigned char* inpos, unsigned char
                                 R0 = match_offset;
                             }
 
-                            rundest = window + window_posn;
-                            runsrc = rundest - match_offset;
-                            window_posn += (uint32_t)match_length;
-                            if (window_posn > window_size)
+                            /* an offset of 0 can come from R0-R2 of an
+                             * uncompressed block header. until the window
+                             * wraps, matches can only refer to what was
+                             * decoded since the last reset: the rest of the
+                             * window may be left from another archive */
+                            if (match_offset == 0 ||
+                                match_offset > (wrapped ? window_size : window_posn) ||
+                                window_posn + (uint32_t)match_length > window_size)
                                 return DECR_ILLEGALDATA;
+                            copy_window_match(window, window_size, window_posn, match_offset,
+                                              (uint32_t)match_length);
+                            window_posn += (uint32_t)match_length;
                             this_run -= match_length;
-
-                            /* copy any wrapped around source data */
-                            while ((runsrc < window) && (match_length-- > 0)) {
-                                *rundest++ = *(runsrc + window_size);
-                                runsrc++;
-                            }
-                            /* copy match data - no worries about destination wraps */
-                            while (match_length-- > 0)
-                                *rundest++ = *runsrc++;
                         }
                     }
                     break;
@@ -765,6 +1037,11 @@ int lzx_decompress(struct lzx_state* pState, unsigned char* inpos, unsigned char
     memcpy(outpos, window + ((!window_posn) ? window_size : window_posn) - outlen, (size_t)outlen);
 
     pState->window_posn = window_posn;
+    if (wrapped || window_posn == window_size) {
+        pState->window_used = window_size;
+    } else if (window_posn > pState->window_used) {
+        pState->window_used = window_posn;
+    }
     pState->R0 = R0;
     pState->R1 = R1;
     pState->R2 = R2;
@@ -776,18 +1053,17 @@ int lzx_decompress(struct lzx_state* pState, unsigned char* inpos, unsigned char
         } else {
             uint8_t* data = outpos;
             uint8_t* dataend = data + outlen - 10;
-            int32_t curpos = pState->intel_curpos;
+            int32_t curpos;
             int32_t filesize = pState->intel_filesize;
             int32_t abs_off, rel_off;
 
-            pState->intel_curpos = curpos + outlen;
-
-            while (data < dataend) {
-                if (*data++ != 0xE8) {
-                    curpos++;
-                    continue;
-                }
-                abs_off = data[0] | (data[1] << 8) | (data[2] << 16) | (data[3] << 24);
+            /* E8 leaders are only looked for in [0, outlen - 10), and the 4
+             * bytes following one are never a leader themselves */
+            while ((data = find_e8(data, dataend)) != NULL) {
+                curpos = pState->intel_curpos + (int32_t)(data - outpos);
+                data++;
+                abs_off = (int32_t)((uint32_t)data[0] | ((uint32_t)data[1] << 8) |
+                                    ((uint32_t)data[2] << 16) | ((uint32_t)data[3] << 24));
                 if ((abs_off >= -curpos) && (abs_off < filesize)) {
                     rel_off = (abs_off >= 0) ? abs_off - curpos : abs_off + filesize;
                     data[0] = (uint8_t)rel_off;
@@ -796,8 +1072,8 @@ int lzx_decompress(struct lzx_state* pState, unsigned char* inpos, unsigned char
                     data[3] = (uint8_t)(rel_off >> 24);
                 }
                 data += 4;
-                curpos += 5;
             }
+            pState->intel_curpos += outlen;
         }
     }
     return DECR_OK;
@@ -29,6 +29,8 @@
 extern "C" {
 #endif
 
+#include <stddef.h>
+
 /* return codes */
 #define DECR_OK (0)
 #define DECR_DATAFORMAT (1)
@@ -44,13 +46,36 @@ struct lzx_state* lzx_init(int window);
 /* destroy an lzx state object */
 void lzx_teardown(struct lzx_state* pState);
 
+/* bytes allocated for a state object, window included */
+size_t lzx_state_size(const struct lzx_state* pState);
+
 /* reset an lzx stream */
 void lzx_reset(struct lzx_state* pState);
 
+/* zero the whole window, e.g. before decoding a different stream with it */
+void lzx_clear_window(struct lzx_state* pState);
+
 /* decompress an LZX compressed block */
 int lzx_decompress(struct lzx_state* pState, unsigned char* inpos, unsigned char* outpos, int inlen,
                    int outlen);
 
+/* opaque copy of the decoder state, including the used part of the window */
+struct lzx_snapshot;
+
+/* capture the current state so decoding can later continue from this point with
+ * lzx_restore(). snap is a previous snapshot to reuse or NULL. returns NULL if out
+ * of memory, in which case snap has been freed */
+struct lzx_snapshot* lzx_snapshot(struct lzx_state* pState, struct lzx_snapshot* snap);
+
+/* go back to the state captured by lzx_snapshot(). pState must have been created
+ * with the same window size */
+void lzx_restore(struct lzx_state* pState, const struct lzx_snapshot* snap);
+
+/* bytes held by a snapshot */
+size_t lzx_snapshot_size(const struct lzx_snapshot* snap);
+
+void lzx_snapshot_free(struct lzx_snapshot* snap);
+
 #ifdef __cplusplus
 }
 #endif
@@ -0,0 +1,184 @@
+/***************************************************************************
+ *             lzx_pool.c - process-wide pool of LZX decoders              *
+ *                           -------------------                           *
+ *                                                                         *
+ *  notes:      Idle decoders are kept on one list, most recently returned *
+ *              first. Handing out a decoder prefers the caller's own,     *
+ *              then the least recently returned one of the right window   *
+ *              size, so that the decoders of busy handles stay resumable  *
+ *              for as long as possible. List nodes of decoders handed out *
+ *              are kept on a spare list for the next release, so that in  *
+ *              steady state acquire and release only relink.              *
+ ***************************************************************************/
+
+/***************************************************************************
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU Lesser General Public License as        *
+ *   published by the Free Software Foundation; either version 2.1 of the  *
+ *   License, or (at your option) any later version.                       *
+ *                                                                         *
+ ***************************************************************************/
+
+#include <stdlib.h>
+
+#include "chm_thread.h"
+#include "lzx.h"
+#include "lzx_pool.h"
+
+/* enough for 16 decoders with the largest (2 MB) window */
+#define LZX_POOL_DEFAULT_LIMIT (16 * ((int64_t)1 << 21) + 16 * 65536)
+
+typedef struct pool_node {
+    struct pool_node* prev; /* towards the most recently returned */
+    struct pool_node* next;
+    struct lzx_state* lzx;
+    const void* owner;
+    int window;
+    size_t size;
+} pool_node;
+
+static chm_mutex g_pool_mu = CHM_MUTEX_INITIALIZER;
+static pool_node* g_idle_first;
+static pool_node* g_idle_last;
+/* nodes not in use, linked through next */
+static pool_node* g_spare_nodes;
+static int64_t g_pool_limit = LZX_POOL_DEFAULT_LIMIT;
+/* memory of all decoders handed out and not freed since */
+static int64_t g_pool_bytes;
+
+static void unlink_node(pool_node* n) {
+    if (n->prev)
+        n->prev->next = n->next;
+    else
+        g_idle_first = n->next;
+    if (n->next)
+        n->next->prev = n->prev;
+    else
+        g_idle_last = n->prev;
+}
+
+/* frees least recently returned idle decoders until need more bytes fit. called
+ * with g_pool_mu held, returns the decoders to free after unlocking */
+static pool_node* evict_idle(int64_t need) {
+    pool_node* freed = NULL;
+    while (g_idle_last != NULL && g_pool_bytes + need > g_pool_limit) {
+        pool_node* n = g_idle_last;
+        unlink_node(n);
+        g_pool_bytes -= (int64_t)n->size;
+        n->next = freed;
+        freed = n;
+    }
+    return freed;
+}
+
+static void free_nodes(pool_node* n) {
+    while (n != NULL) {
+        pool_node* next = n->next;
+        lzx_teardown(n->lzx);
+        free(n);
+        n = next;
+    }
+}
+
+struct lzx_state* lzx_pool_acquire(int window, const void* owner, bool* resumed) {
+    pool_node* found = NULL;
+    *resumed = false;
+
+    chm_mutex_lock(&g_pool_mu);
+    for (pool_node* n = g_idle_first; n != NULL; n = n->next) {
+        if (n->window != window)
+            continue;
+        if (owner != NULL && n->owner == owner) {
+            found = n;
+            *resumed = true;
+            break;
+        }
+        found = n; /* keep looking, the last match is the least recent */
+    }
+    if (found != NULL) {
+        struct lzx_state* lzx = found->lzx;
+        unlink_node(found);
+        found->lzx = NULL;
+        found->next = g_spare_nodes;
+        g_spare_nodes = found;
+        chm_mutex_unlock(&g_pool_mu);
+        if (!*resumed) {
+            /* it may have decoded another archive, which must not show
+             * through in the new owner's output even if its data is corrupt */
+            lzx_clear_window(lzx);
+        }
+        return lzx;
+    }
+    chm_mutex_unlock(&g_pool_mu);
+
+    struct lzx_state* lzx = lzx_init(window);
+    if (lzx == NULL) {
+        return NULL;
+    }
+    int64_t size = (int64_t)lzx_state_size(lzx);
+    chm_mutex_lock(&g_pool_mu);
+    pool_node* freed = evict_idle(size);
+    g_pool_bytes += size;
+    chm_mutex_unlock(&g_pool_mu);
+    free_nodes(freed);
+    return lzx;
+}
+
+void lzx_pool_release(struct lzx_state* lzx, int window, const void* owner) {
+    if (lzx == NULL) {
+        return;
+    }
+    int64_t size = (int64_t)lzx_state_size(lzx);
+
+    chm_mutex_lock(&g_pool_mu);
+    pool_node* n = g_spare_nodes;
+    if (n != NULL) {
+        g_spare_nodes = n->next;
+    } else if (g_pool_bytes <= g_pool_limit) {
+        /* only until there's a node for every decoder around */
+        chm_mutex_unlock(&g_pool_mu);
+        n = (pool_node*)malloc(sizeof(pool_node));
+        chm_mutex_lock(&g_pool_mu);
+    }
+    if (n == NULL || g_pool_bytes > g_pool_limit) {
+        g_pool_bytes -= size;
+        if (n != NULL) {
+            n->next = g_spare_nodes;
+            g_spare_nodes = n;
+        }
+        chm_mutex_unlock(&g_pool_mu);
+        lzx_teardown(lzx);
+        return;
+    }
+    n->lzx = lzx;
+    n->owner = owner;
+    n->window = window;
+    n->size = (size_t)size;
+    n->prev = NULL;
+    n->next = g_idle_first;
+    if (g_idle_first)
+        g_idle_first->prev = n;
+    else
+        g_idle_last = n;
+    g_idle_first = n;
+    chm_mutex_unlock(&g_pool_mu);
+}
+
+void lzx_pool_forget(const void* owner) {
+    chm_mutex_lock(&g_pool_mu);
+    for (pool_node* n = g_idle_first; n != NULL; n = n->next) {
+        if (n->owner == owner) {
+            n->owner = NULL;
+        }
+    }
+    chm_mutex_unlock(&g_pool_mu);
+}
+
+void lzx_pool_set_limit(int64_t bytes) {
+    chm_mutex_lock(&g_pool_mu);
+    g_pool_limit = bytes < 0 ? 0 : bytes;
+    pool_node* freed = evict_idle(0);
+    chm_mutex_unlock(&g_pool_mu);
+    free_nodes(freed);
+}
@@ -0,0 +1,57 @@
+/***************************************************************************
+ *             lzx_pool.h - process-wide pool of LZX decoders              *
+ *                           -------------------                           *
+ *                                                                         *
+ *  notes:      A decoder (state plus a window of up to 2 MB) is only      *
+ *              needed while decompressing, so chm_file handles borrow     *
+ *              one for the duration of a read and give it back after.     *
+ *              Idle decoders remember who returned them, so a handle that *
+ *              gets its own decoder back can continue where it left off.  *
+ *                                                                         *
+ *              Thread-safe.                                               *
+ ***************************************************************************/
+
+/***************************************************************************
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU Lesser General Public License as        *
+ *   published by the Free Software Foundation; either version 2.1 of the  *
+ *   License, or (at your option) any later version.                       *
+ *                                                                         *
+ ***************************************************************************/
+
+#ifndef INCLUDED_LZX_POOL_H
+#define INCLUDED_LZX_POOL_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stdbool.h>
+#include <stdint.h>
+
+struct lzx_state;
+
+/* borrow a decoder for the given window size (15..21), preferably the one
+ * owner returned last. *resumed is set to true if that's the one returned,
+ * i.e. it's still in the state owner left it in. otherwise its window is
+ * zeroed but the rest is in an unknown state, and it must be reset or
+ * restored before use. owner can be NULL */
+struct lzx_state* lzx_pool_acquire(int window, const void* owner, bool* resumed);
+
+/* give back a decoder from lzx_pool_acquire() */
+void lzx_pool_release(struct lzx_state* lzx, int window, const void* owner);
+
+/* owner is going away, its idle decoders are up for grabs */
+void lzx_pool_forget(const void* owner);
+
+/* cap on the memory of all decoders, in use or idle. idle decoders are freed
+ * to stay under it. decoders in use aren't limited: if none can be freed a
+ * new one is allocated anyway, and freed when it's returned */
+void lzx_pool_set_limit(int64_t bytes);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* INCLUDED_LZX_POOL_H */
@@ -0,0 +1,107 @@
+/***************************************************************************
+ *          bench.c - LZX decoding throughput                              *
+ *                           -------------------                           *
+ *                                                                         *
+ *  notes:      Decompresses the whole MSCompressed section of a .chm file *
+ *              a number of times and reports the decoding speed in MB/s   *
+ *              of uncompressed output. The file is memory mapped so the   *
+ *              numbers are about the decoder, not about I/O.              *
+ ***************************************************************************/
+
+/***************************************************************************
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU Lesser General Public License as        *
+ *   published by the Free Software Foundation; either version 2.1 of the  *
+ *   License, or (at your option) any later version.                       *
+ *                                                                         *
+ ***************************************************************************/
+
+#include "chm_lib.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#ifdef WIN32
+#include <windows.h>
+#else
+#include <time.h>
+#endif
+
+static double now_seconds(void) {
+#ifdef WIN32
+    LARGE_INTEGER freq, t;
+    QueryPerformanceFrequency(&freq);
+    QueryPerformanceCounter(&t);
+    return (double)t.QuadPart / (double)freq.QuadPart;
+#else
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double)ts.tv_sec + (double)ts.tv_nsec / 1e9;
+#endif
+}
+
+static bool bench(chm_file* h, int iterations, int nThreads) {
+    int64_t len = h->reset_table.uncompressed_len;
+    uint8_t* buf = (uint8_t*)malloc((size_t)len);
+    if (buf == NULL) {
+        fprintf(stderr, "out of memory\n");
+        return false;
+    }
+
+    double best = 0;
+    for (int i = 0; i < iterations; i++) {
+        double start = now_seconds();
+        int64_t got = chm_decompress_range(h, buf, 0, len, nThreads);
+        double elapsed = now_seconds() - start;
+        if (got != len) {
+            fprintf(stderr, "decompression failed at offset %lld\n", (long long)got);
+            free(buf);
+            return false;
+        }
+        if (i == 0 || elapsed < best) {
+            best = elapsed;
+        }
+    }
+    free(buf);
+
+    double mb = (double)len / (1024.0 * 1024.0);
+    double cmb = (double)h->reset_table.compressed_len / (1024.0 * 1024.0);
+    printf("%.1f MB (%.1f MB compressed, %lld blocks) in %.3f s: %.1f MB/s\n", mb, cmb,
+           (long long)h->reset_table.block_count, best, mb / best);
+    return true;
+}
+
+int main(int c, char** v) {
+    if (c < 2) {
+        fprintf(stderr, "usage: %s <chmfile> [iterations] [threads]\n", v[0]);
+        exit(1);
+    }
+    int iterations = c > 2 ? atoi(v[2]) : 5;
+    int nThreads = c > 3 ? atoi(v[3]) : 1;
+    if (iterations < 1) {
+        iterations = 1;
+    }
+
+    mmap_reader_ctx ctx;
+    if (!mmap_reader_init(&ctx, v[1])) {
+        fprintf(stderr, "failed to open %s\n", v[1]);
+        exit(1);
+    }
+    chm_file f;
+    if (!chm_parse_lazy(&f, mmap_reader, &ctx)) {
+        fprintf(stderr, "chm_parse_lazy() failed\n");
+        mmap_reader_close(&ctx);
+        exit(1);
+    }
+    if (!f.compression_enabled) {
+        fprintf(stderr, "%s has no compressed content\n", v[1]);
+        chm_close(&f);
+        mmap_reader_close(&ctx);
+        exit(1);
+    }
+    bool ok = bench(&f, iterations, nThreads);
+    chm_close(&f);
+    mmap_reader_close(&ctx);
+    return ok ? 0 : 1;
+}
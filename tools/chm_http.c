@@ -25,33 +25,68 @@ j *              in fact, probably badly broken for any serious usage.      *
  *   License, or (at your option) any later version.                       *
  *                                                                         *
  ***************************************************************************/
+/* for accept4() */
+#define _GNU_SOURCE
 
 #include "chm_lib.h"
 
 /* standard system includes */
+#include <dirent.h>
+#include <errno.h>
+#include <limits.h>
+#include <signal.h>
+#include <stdarg.h>
+#include <stddef.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <strings.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/stat.h>
 
 /* includes for networking */
 #include <sys/socket.h>
 #include <sys/types.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <arpa/inet.h>
 
+/* includes for the event loop (linux only) */
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/sendfile.h>
+
 /* threading includes */
 #include <pthread.h>
 
+/* encoders for precompressed responses, each optional */
+#ifdef CHM_HTTP_GZIP
+#include <zlib.h>
+#endif
+#ifdef CHM_HTTP_BROTLI
+#include <brotli/encode.h>
+#endif
+#ifdef CHM_HTTP_ZSTD
+#include <zstd.h>
+#endif
+
 #include <getopt.h>
 
 static int config_port = 8080;
 static char config_bind[65536] = "0.0.0.0";
+static int config_threads = 0; /* 0 means one per cpu */
+static int config_pack_cache = 64; /* MB of precompressed responses */
+static int config_max_open = 64;   /* archives kept open when serving a directory */
 
 static void usage(const char* argv0) {
 #ifdef CHM_HTTP_SIMPLE
-    fprintf(stderr, "usage: %s <filename>\n", argv0);
+    fprintf(stderr, "usage: %s <filename or directory>\n", argv0);
 #else
-    fprintf(stderr, "usage: %s [--port=PORT] [--bind=IP] <filename>\n", argv0);
+    fprintf(stderr,
+            "usage: %s [--port=PORT] [--bind=IP] [--threads=N] [--pack-cache=MB] [--max-open=N] "
+            "<filename or directory>\n",
+            argv0);
 #endif
 }
 
@@ -73,12 +108,15 @@ int main(int c, char** v) {
 
     struct option longopts[] = {{"port", required_argument, 0, 'p'},
                                 {"bind", required_argument, 0, 'b'},
+                                {"threads", required_argument, 0, 't'},
+                                {"pack-cache", required_argument, 0, 'c'},
+                                {"max-open", required_argument, 0, 'm'},
                                 {"help", no_argument, 0, 'h'},
                                 {0, 0, 0, 0}};
 
     while (1) {
         int o;
-        o = getopt_long(c, v, "n:b:h", longopts, &optindex);
+        o = getopt_long(c, v, "p:b:t:c:m:h", longopts, &optindex);
         if (o < 0) {
             break;
         }
@@ -97,6 +135,30 @@ int main(int c, char** v) {
                 config_bind[65535] = '\0';
                 break;
 
+            case 't':
+                config_threads = atoi(optarg);
+                if (config_threads <= 0) {
+                    fprintf(stderr, "bad thread count (%s)\n", optarg);
+                    exit(1);
+                }
+                break;
+
+            case 'c':
+                config_pack_cache = atoi(optarg);
+                if (config_pack_cache < 0) {
+                    fprintf(stderr, "bad cache size (%s)\n", optarg);
+                    exit(1);
+                }
+                break;
+
+            case 'm':
+                config_max_open = atoi(optarg);
+                if (config_max_open <= 0) {
+                    fprintf(stderr, "bad number of open archives (%s)\n", optarg);
+                    exit(1);
+                }
+                break;
+
             case 'h':
                 usage(v[0]);
                 break;
@@ -105,6 +167,7 @@ int main(int c, char** v) {
 
     if (optind + 1 != c) {
         usage(v[0]);
+        return 1;
     }
 
     /* run the server */
@@ -114,104 +177,770 @@ int main(int c, char** v) {
     return res;
 }
 
-struct chmHttpServer {
-    int socket;
-    chm_file file;
-};
+/*
+ * The server is a single epoll loop that accepts connections, reads and parses
+ * requests and writes responses, all non-blocking. Anything that touches the
+ * archive (looking up entries, decompressing) is handed to a fixed pool of
+ * worker threads so a slow decode never holds up other connections.
+ *
+ * A connection is always in one of three states:
+ *  - reading: waiting for a complete request
+ *  - working: a worker owns it and is filling its output buffer. The event loop
+ *             doesn't touch it until the worker hands it back
+ *  - writing: sending the output buffer. Large entries are sent a chunk at a
+ *             time; when a chunk is out, the connection goes back to a worker
+ *             for the next one. Uncompressed entries are sent by the event
+ *             loop itself with sendfile(), straight from the archive
+ * Requests are answered one at a time, in order. Pipelined requests wait in the
+ * input buffer (or the socket) until the response before them is sent.
+ *
+ * Text entries are compressed once per content encoding clients ask for, and
+ * the results kept in memory (see pack_cache), so hot pages are sent without
+ * any LZX work.
+ *
+ * Given a directory instead of a .chm file, the server serves every .chm file
+ * under it, each under its own name: /docs/manual.chm/index.htm is index.htm in
+ * <directory>/docs/manual.chm. Archives are opened on first use and the least
+ * recently used idle ones closed to stay within --max-open.
+ */
 
-struct chmHttpSlave {
-    int fd;
-    struct chmHttpServer* server;
-};
+/* request line and headers must fit in this */
+#define MAX_REQUEST 8192
+/* how much of an entry's body is decoded at a time */
+#define BODY_CHUNK 65536
+/* max bytes per sendfile() call, so one client can't hog the event loop */
+#define SENDFILE_CHUNK (1 << 20)
+/* longest Range, If-Range or If-None-Match value we look at */
+#define MAX_HEADER_VALUE 256
+/* idle keep-alive connections and stalled clients are dropped after this many seconds */
+#define IDLE_TIMEOUT 30
+#define MAX_EVENTS 64
 
-static void* _slave(void* param);
+enum { CONN_READING, CONN_WORKING, CONN_WRITING };
 
-static int chmhttp_server(const char* path) {
-    struct chmHttpServer server;
-    struct chmHttpSlave* slave;
-    struct sockaddr_in bindAddr;
-    socklen_t addrLen;
-    pthread_t tid;
-    int one = 1;
+enum { METHOD_GET, METHOD_HEAD, METHOD_OTHER };
+
+/* growable output buffer, data[pos..len) is still to be sent */
+typedef struct http_buf {
+    char* data;
+    size_t len;
+    size_t pos;
+    size_t cap;
+    bool oom;
+} http_buf;
+
+typedef struct http_request {
+    int method;
+    int minor_version; /* HTTP/1.x */
+    bool keep_alive;
+    /* empty if not sent (or too long to be of interest) */
+    char range[MAX_HEADER_VALUE];
+    char if_range[MAX_HEADER_VALUE];
+    char if_none_match[MAX_HEADER_VALUE];
+    char accept_encoding[MAX_HEADER_VALUE];
+    char path[MAX_REQUEST];
+} http_request;
+
+typedef struct http_conn {
+    struct http_conn* prev; /* all open connections, for the idle sweep */
+    struct http_conn* next;
+    struct http_conn* queue_next; /* in the job, done or dead queue */
+    struct http_server* server;
+    int fd; /* -1 once closed */
+    int state;
+    uint32_t events; /* what epoll watches for */
+    time_t last_active;
+    size_t in_len;
+    char in[MAX_REQUEST];
+    http_request req;
+    http_buf out;
+    /* the rest of the body, filled in by a worker whenever out is drained.
+     * whole entries are read through stream if one is free (see max_streams),
+     * ranges and the rest with chm_retrieve_entry() */
+    chm_stream* stream;
+    chm_entry* entry;
+    int64_t body_off;
+    int64_t body_left;
+    /* or the body is this range of the archive, sent after out */
+    int64_t file_off;
+    int64_t file_left;
+    /* or a precompressed copy of the entry, sent after out */
+    struct packed_entry* packed;
+    size_t packed_off;
+    /* archive the response comes from, kept open until it's sent */
+    struct http_archive* archive;
+} http_conn;
+
+typedef struct conn_queue {
+    http_conn* first;
+    http_conn* last;
+} conn_queue;
 
+#define ARCHIVE_BUCKETS 1024
+
+typedef struct http_archive {
+    struct http_archive* prev; /* idle list, towards the most recently used */
+    struct http_archive* next;
+    struct http_archive* hash_next;
+    char* name; /* path relative to the served directory */
+    int refs;   /* responses using it */
+    bool opening;
     fd_reader_ctx ctx;
-    if (!fd_reader_init(&ctx, path)) {
-        fprintf(stderr, "failed to open %s\n", path);
-        return 1;
+    chm_file file;
+} http_archive;
+
+typedef struct http_server {
+    int socket;
+    int epfd;
+    int wakefd; /* eventfd, signaled by workers when a job is done */
+    http_conn* conns;
+    conn_queue dead; /* closed, freed at the end of the loop iteration */
+
+    pthread_mutex_t mu; /* guards jobs, done and n_streams */
+    pthread_cond_t has_job;
+    conn_queue jobs;
+    conn_queue done;
+    /* a stream holds an LZX decoder until its response is sent, which can take
+     * as long as the client likes. Open streams are capped to one per worker */
+    int n_streams;
+    int max_streams;
+
+    /* what's served: a single archive, or all archives under root */
+    http_archive* single;
+    const char* root;
+    pthread_mutex_t archives_mu; /* guards the fields below and archive refs */
+    pthread_cond_t archive_opened;
+    http_archive* archives[ARCHIVE_BUCKETS];
+    /* open archives no response uses, most recently used first */
+    http_archive* idle_first;
+    http_archive* idle_last;
+    int n_open;
+} http_server;
+
+static void queue_push(conn_queue* q, http_conn* c) {
+    c->queue_next = NULL;
+    if (q->last)
+        q->last->queue_next = c;
+    else
+        q->first = c;
+    q->last = c;
+}
+
+static http_conn* queue_pop(conn_queue* q) {
+    http_conn* c = q->first;
+    if (c != NULL) {
+        q->first = c->queue_next;
+        if (q->first == NULL)
+            q->last = NULL;
     }
-    bool ok = chm_parse(&server.file, fd_reader, &ctx);
-    if (!ok) {
-        fprintf(stderr, "couldn't open file '%s'\n", path);
-        fd_reader_close(&ctx);
-        return 2;
+    return c;
+}
+
+static bool buf_reserve(http_buf* b, size_t n) {
+    if (b->oom) {
+        return false;
     }
+    if (b->len + n <= b->cap) {
+        return true;
+    }
+    size_t cap = b->cap ? b->cap : 1024;
+    while (cap < b->len + n) {
+        cap *= 2;
+    }
+    char* data = (char*)realloc(b->data, cap);
+    if (data == NULL) {
+        b->oom = true;
+        return false;
+    }
+    b->data = data;
+    b->cap = cap;
+    return true;
+}
 
-    server.socket = socket(AF_INET, SOCK_STREAM, 0);
-    memset(&bindAddr, 0, sizeof(struct sockaddr_in));
-    bindAddr.sin_family = AF_INET;
-    bindAddr.sin_port = htons(config_port);
-    bindAddr.sin_addr.s_addr = inet_addr(config_bind);
+static void buf_append(http_buf* b, const void* data, size_t len) {
+    if (buf_reserve(b, len)) {
+        memcpy(b->data + b->len, data, len);
+        b->len += len;
+    }
+}
 
-    if (setsockopt(server.socket, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one))) {
-        perror("setsockopt");
-        return 3;
+static void buf_printf(http_buf* b, const char* fmt, ...) {
+    va_list args;
+    va_start(args, fmt);
+    int n = vsnprintf(NULL, 0, fmt, args);
+    va_end(args);
+    if (n < 0 || !buf_reserve(b, (size_t)n + 1)) {
+        return;
     }
+    va_start(args, fmt);
+    vsnprintf(b->data + b->len, (size_t)n + 1, fmt, args);
+    va_end(args);
+    b->len += (size_t)n;
+}
 
-    if (bind(server.socket, (struct sockaddr*)&bindAddr, sizeof(struct sockaddr_in)) < 0) {
-        close(server.socket);
-        server.socket = -1;
-        fprintf(stderr, "couldn't bind to ip %s port %d\n", config_bind, config_port);
-        return 3;
+static void buf_reset(http_buf* b) {
+    b->len = 0;
+    b->pos = 0;
+    b->oom = false;
+}
+
+static void buf_free(http_buf* b) {
+    free(b->data);
+    memset(b, 0, sizeof(*b));
+}
+
+/* appends path %-encoded for use in a URL */
+static void buf_append_url(http_buf* b, const char* path) {
+    for (const uint8_t* p = (const uint8_t*)path; *p; p++) {
+        if ((*p >= 'a' && *p <= 'z') || (*p >= 'A' && *p <= 'Z') || (*p >= '0' && *p <= '9') ||
+            strchr("/-._~", *p) != NULL) {
+            buf_append(b, p, 1);
+        } else {
+            buf_printf(b, "%%%02X", *p);
+        }
     }
+}
 
-    /* listen for connections */
-    listen(server.socket, 75);
-    addrLen = sizeof(struct sockaddr);
-    while (1) {
-        slave = (struct chmHttpSlave*)malloc(sizeof(struct chmHttpSlave));
-        slave->server = &server;
-        slave->fd = accept(server.socket, (struct sockaddr*)&bindAddr, &addrLen);
-        if (slave->fd == -1)
-            break;
+/*
+ * Precompressed responses. A text entry is compressed once per content encoding
+ * and kept in pack_cache, keyed by the ETag of that encoding, so it can be sent
+ * again without decompressing or compressing anything. The cache is bounded by
+ * --pack-cache and drops the least recently used entries first. Entries are
+ * reference counted: one being sent stays alive after it's evicted.
+ */
 
-        pthread_create(&tid, NULL, _slave, (void*)slave);
-        pthread_detach(tid);
+/* in order of preference when a client accepts several */
+enum { ENC_IDENTITY, ENC_BROTLI, ENC_ZSTD, ENC_GZIP, ENC_COUNT };
+
+static const char* enc_names[ENC_COUNT] = {"identity", "br", "zstd", "gzip"};
+
+/* smaller entries don't gain much, larger ones would crowd out the rest */
+#define PACK_MIN_SIZE 256
+#define PACK_MAX_SIZE (4 << 20)
+#define PACK_BUCKETS 4096
+
+typedef struct packed_entry {
+    struct packed_entry* prev; /* towards the most recently used */
+    struct packed_entry* next;
+    struct packed_entry* hash_next;
+    int refs; /* one for the cache, one per response sending it */
+    bool cached;
+    char etag[80];
+    size_t orig_len;
+    size_t len;
+    uint8_t data[];
+} packed_entry;
+
+typedef struct pack_cache {
+    pthread_mutex_t mu;
+    packed_entry* buckets[PACK_BUCKETS];
+    packed_entry* first;
+    packed_entry* last;
+    int n_entries;
+    int64_t bytes;
+    int64_t orig_bytes; /* what the cached entries are uncompressed */
+    int64_t limit;
+    int64_t hits;
+    int64_t misses;
+    int64_t evictions;
+} pack_cache;
+
+static pack_cache g_packs;
+
+static bool enc_supported(int enc) {
+    switch (enc) {
+#ifdef CHM_HTTP_GZIP
+        case ENC_GZIP:
+            return true;
+#endif
+#ifdef CHM_HTTP_BROTLI
+        case ENC_BROTLI:
+            return true;
+#endif
+#ifdef CHM_HTTP_ZSTD
+        case ENC_ZSTD:
+            return true;
+#endif
+        default:
+            return false;
     }
-    free(slave);
-    return 0;
 }
 
-static void service_request(int fd, struct chm_file* file);
+/* true if the Accept-Encoding list allows token, explicitly or through "*" */
+static bool accepts_token(const char* list, const char* token) {
+    size_t n = strlen(token);
+    bool star = false;
+    const char* p = list;
+    while (*p) {
+        while (*p == ' ' || *p == '\t' || *p == ',')
+            p++;
+        const char* name = p;
+        while (*p && *p != ',' && *p != ';' && *p != ' ' && *p != '\t')
+            p++;
+        size_t len = (size_t)(p - name);
+        double q = 1;
+        while (*p && *p != ',') {
+            if (*p++ != ';')
+                continue;
+            while (*p == ' ')
+                p++;
+            if ((*p == 'q' || *p == 'Q') && p[1] == '=')
+                q = atof(p + 2);
+        }
+        if (len == n && strncasecmp(name, token, n) == 0)
+            return q > 0;
+        if (len == 1 && *name == '*')
+            star = q > 0;
+    }
+    return star;
+}
+
+/* the encoding to send, ENC_IDENTITY if the client accepts none we have */
+static int choose_encoding(const char* accept) {
+    if (accept[0] == '\0') {
+        return ENC_IDENTITY;
+    }
+    for (int enc = ENC_IDENTITY + 1; enc < ENC_COUNT; enc++) {
+        if (enc_supported(enc) && accepts_token(accept, enc_names[enc])) {
+            return enc;
+        }
+    }
+    return ENC_IDENTITY;
+}
+
+#if defined(CHM_HTTP_GZIP) || defined(CHM_HTTP_BROTLI) || defined(CHM_HTTP_ZSTD)
+static packed_entry* pack_alloc(size_t cap) {
+    return (packed_entry*)calloc(1, sizeof(packed_entry) + cap);
+}
+#endif
 
-static void* _slave(void* param) {
-    struct chmHttpSlave* slave;
-    struct chm_file* file;
+#ifdef CHM_HTTP_GZIP
+static packed_entry* pack_gzip(const uint8_t* data, size_t len) {
+    z_stream zs;
+    memset(&zs, 0, sizeof(zs));
+    /* 15 + 16: largest window, with a gzip header */
+    if (deflateInit2(&zs, Z_BEST_COMPRESSION, Z_DEFLATED, 15 + 16, 9, Z_DEFAULT_STRATEGY) != Z_OK) {
+        return NULL;
+    }
+    size_t bound = deflateBound(&zs, (uLong)len);
+    packed_entry* p = pack_alloc(bound);
+    if (p != NULL) {
+        zs.next_in = (Bytef*)data;
+        zs.avail_in = (uInt)len;
+        zs.next_out = p->data;
+        zs.avail_out = (uInt)bound;
+        if (deflate(&zs, Z_FINISH) == Z_STREAM_END) {
+            p->len = zs.total_out;
+        } else {
+            free(p);
+            p = NULL;
+        }
+    }
+    deflateEnd(&zs);
+    return p;
+}
+#endif
 
-    /* grab our relevant information */
-    slave = (struct chmHttpSlave*)param;
-    file = &slave->server->file;
+#ifdef CHM_HTTP_BROTLI
+static packed_entry* pack_brotli(const uint8_t* data, size_t len) {
+    size_t bound = BrotliEncoderMaxCompressedSize(len);
+    packed_entry* p = bound ? pack_alloc(bound) : NULL;
+    if (p == NULL) {
+        return NULL;
+    }
+    /* quality 11 is several times slower for a few percent, and a request is
+     * waiting for this */
+    p->len = bound;
+    if (!BrotliEncoderCompress(9, BROTLI_DEFAULT_WINDOW, BROTLI_MODE_TEXT, len, data, &p->len,
+                               p->data)) {
+        free(p);
+        return NULL;
+    }
+    return p;
+}
+#endif
 
-    /* handle request */
-    service_request(slave->fd, file);
+#ifdef CHM_HTTP_ZSTD
+static packed_entry* pack_zstd(const uint8_t* data, size_t len) {
+    size_t bound = ZSTD_compressBound(len);
+    packed_entry* p = pack_alloc(bound);
+    if (p == NULL) {
+        return NULL;
+    }
+    /* like brotli, high but well short of the slowest levels */
+    size_t n = ZSTD_compress(p->data, bound, data, len, 15);
+    if (ZSTD_isError(n)) {
+        free(p);
+        return NULL;
+    }
+    p->len = n;
+    return p;
+}
+#endif
 
-    /* free our resources and return */
-    close(slave->fd);
-    free(slave);
+/* NULL if out of memory or data doesn't get any smaller */
+static packed_entry* pack_compress(int enc, const uint8_t* data, size_t len) {
+    packed_entry* p = NULL;
+    switch (enc) {
+#ifdef CHM_HTTP_GZIP
+        case ENC_GZIP:
+            p = pack_gzip(data, len);
+            break;
+#endif
+#ifdef CHM_HTTP_BROTLI
+        case ENC_BROTLI:
+            p = pack_brotli(data, len);
+            break;
+#endif
+#ifdef CHM_HTTP_ZSTD
+        case ENC_ZSTD:
+            p = pack_zstd(data, len);
+            break;
+#endif
+        default:
+            (void)data;
+            break;
+    }
+    if (p == NULL || p->len >= len) {
+        free(p);
+        return NULL;
+    }
+    /* the bound is usually well above what it took */
+    packed_entry* shrunk = (packed_entry*)realloc(p, sizeof(packed_entry) + p->len);
+    if (shrunk != NULL) {
+        p = shrunk;
+    }
+    p->orig_len = len;
+    return p;
+}
+
+static packed_entry** pack_bucket(const char* etag) {
+    uint32_t h = 2166136261u;
+    for (const char* s = etag; *s; s++) {
+        h = (h ^ (uint8_t)*s) * 16777619u;
+    }
+    return &g_packs.buckets[h % PACK_BUCKETS];
+}
+
+static packed_entry* pack_find(const char* etag) {
+    for (packed_entry* p = *pack_bucket(etag); p != NULL; p = p->hash_next) {
+        if (strcmp(p->etag, etag) == 0) {
+            return p;
+        }
+    }
     return NULL;
 }
 
+static void pack_unlink_lru(packed_entry* p) {
+    if (p->prev)
+        p->prev->next = p->next;
+    else
+        g_packs.first = p->next;
+    if (p->next)
+        p->next->prev = p->prev;
+    else
+        g_packs.last = p->prev;
+}
+
+static void pack_push_front(packed_entry* p) {
+    p->prev = NULL;
+    p->next = g_packs.first;
+    if (g_packs.first)
+        g_packs.first->prev = p;
+    else
+        g_packs.last = p;
+    g_packs.first = p;
+}
+
+/* called with g_packs.mu held. returns true if p should be freed */
+static bool pack_evict(packed_entry* p) {
+    packed_entry** pp = pack_bucket(p->etag);
+    while (*pp != p)
+        pp = &(*pp)->hash_next;
+    *pp = p->hash_next;
+    pack_unlink_lru(p);
+    p->cached = false;
+    g_packs.n_entries--;
+    g_packs.bytes -= (int64_t)p->len;
+    g_packs.orig_bytes -= (int64_t)p->orig_len;
+    g_packs.evictions++;
+    return --p->refs == 0;
+}
+
+/* a reference to the cached response with this ETag, or NULL */
+static packed_entry* pack_lookup(const char* etag) {
+    pthread_mutex_lock(&g_packs.mu);
+    packed_entry* p = pack_find(etag);
+    if (p != NULL) {
+        p->refs++;
+        pack_unlink_lru(p);
+        pack_push_front(p);
+        g_packs.hits++;
+    } else {
+        g_packs.misses++;
+    }
+    pthread_mutex_unlock(&g_packs.mu);
+    return p;
+}
+
+/* caches p, a new entry, and returns it with a reference for the caller. if
+ * another worker cached the same response meanwhile, p is dropped for that one */
+static packed_entry* pack_insert(packed_entry* p) {
+    packed_entry* freed = NULL;
+    pthread_mutex_lock(&g_packs.mu);
+    packed_entry* other = pack_find(p->etag);
+    if (other != NULL) {
+        other->refs++;
+        pthread_mutex_unlock(&g_packs.mu);
+        free(p);
+        return other;
+    }
+    p->refs = 1;
+    if ((int64_t)p->len > g_packs.limit) {
+        pthread_mutex_unlock(&g_packs.mu);
+        return p;
+    }
+    p->refs++;
+    p->cached = true;
+    packed_entry** bucket = pack_bucket(p->etag);
+    p->hash_next = *bucket;
+    *bucket = p;
+    pack_push_front(p);
+    g_packs.n_entries++;
+    g_packs.bytes += (int64_t)p->len;
+    g_packs.orig_bytes += (int64_t)p->orig_len;
+    while (g_packs.bytes > g_packs.limit) {
+        packed_entry* victim = g_packs.last;
+        if (pack_evict(victim)) {
+            victim->next = freed;
+            freed = victim;
+        }
+    }
+    pthread_mutex_unlock(&g_packs.mu);
+    while (freed != NULL) {
+        packed_entry* next = freed->next;
+        free(freed);
+        freed = next;
+    }
+    return p;
+}
+
+static void pack_release(packed_entry* p) {
+    if (p == NULL) {
+        return;
+    }
+    pthread_mutex_lock(&g_packs.mu);
+    bool dead = --p->refs == 0;
+    pthread_mutex_unlock(&g_packs.mu);
+    if (dead) {
+        free(p);
+    }
+}
+
+/*
+ * Archives served from a directory. All open archives are in the hash table;
+ * those no response is using are also on the idle list. When more than
+ * --max-open are open, idle ones are closed, least recently used first. Archives
+ * in use are never closed, so the limit can be exceeded while they're busy.
+ */
+
+static bool has_chm_ext(const char* name, size_t len) {
+    return len > 4 && strncasecmp(name + len - 4, ".chm", 4) == 0;
+}
+
+/* splits "/dir/name.chm/rest" at the first component ending in .chm. false if
+ * there's none, or the path tries to get out of the served directory */
+static bool split_archive_path(const char* path, char* name, const char** rest) {
+    const char* p = path + 1;
+    while (1) {
+        const char* end = strchr(p, '/');
+        if (end == NULL)
+            end = p + strlen(p);
+        size_t len = (size_t)(end - p);
+        if (len == 0 || (len == 1 && p[0] == '.') || (len == 2 && p[0] == '.' && p[1] == '.'))
+            return false;
+        if (has_chm_ext(p, len)) {
+            memcpy(name, path + 1, (size_t)(end - path - 1));
+            name[end - path - 1] = '\0';
+            *rest = end;
+            return true;
+        }
+        if (*end == '\0')
+            return false;
+        p = end + 1;
+    }
+}
+
+static http_archive** archive_bucket(http_server* s, const char* name) {
+    uint32_t h = 2166136261u;
+    for (const char* p = name; *p; p++) {
+        h = (h ^ (uint8_t)*p) * 16777619u;
+    }
+    return &s->archives[h % ARCHIVE_BUCKETS];
+}
+
+static void archive_unhash(http_server* s, http_archive* a) {
+    http_archive** pp = archive_bucket(s, a->name);
+    while (*pp != a)
+        pp = &(*pp)->hash_next;
+    *pp = a->hash_next;
+}
+
+static void idle_unlink(http_server* s, http_archive* a) {
+    if (a->prev)
+        a->prev->next = a->next;
+    else
+        s->idle_first = a->next;
+    if (a->next)
+        a->next->prev = a->prev;
+    else
+        s->idle_last = a->prev;
+}
+
+/* called with archives_mu held. takes idle archives over the limit out of the
+ * table, for archive_close() once the lock is released */
+static http_archive* archive_trim(http_server* s) {
+    http_archive* closed = NULL;
+    while (s->n_open > config_max_open && s->idle_last != NULL) {
+        http_archive* a = s->idle_last;
+        idle_unlink(s, a);
+        archive_unhash(s, a);
+        s->n_open--;
+        a->next = closed;
+        closed = a;
+    }
+    return closed;
+}
+
+static void archive_close(http_archive* a) {
+    while (a != NULL) {
+        http_archive* next = a->next;
+        chm_close(&a->file);
+        fd_reader_close(&a->ctx);
+        free(a->name);
+        free(a);
+        a = next;
+    }
+}
+
+/* opens path into a. a handle serving a directory uses the shared block cache,
+ * so the memory for decompressed blocks doesn't grow with the number of archives */
+static bool archive_open(http_archive* a, const char* path, bool shared) {
+    struct stat st;
+    if (!fd_reader_init(&a->ctx, path)) {
+        return false;
+    }
+    if (fstat(a->ctx.fd, &st) != 0 || !S_ISREG(st.st_mode) ||
+        !chm_parse(&a->file, fd_reader, &a->ctx)) {
+        fd_reader_close(&a->ctx);
+        return false;
+    }
+    /* a file replaced under the same name gets a new archive_id, and new ETags */
+    chm_add_archive_id_data(&a->file, &st.st_size, sizeof(st.st_size));
+    chm_add_archive_id_data(&a->file, &st.st_mtime, sizeof(st.st_mtime));
+    if (shared) {
+        chm_use_shared_cache(&a->file, true);
+    }
+    return true;
+}
+
+/* the archive called name under the served directory, opening it if needed.
+ * NULL if there's no such archive */
+static http_archive* archive_acquire(http_server* s, const char* name) {
+    http_archive* a;
+    pthread_mutex_lock(&s->archives_mu);
+    while (1) {
+        for (a = *archive_bucket(s, name); a != NULL; a = a->hash_next) {
+            if (strcmp(a->name, name) == 0)
+                break;
+        }
+        if (a == NULL || !a->opening)
+            break;
+        /* another worker is opening it */
+        pthread_cond_wait(&s->archive_opened, &s->archives_mu);
+    }
+    if (a != NULL) {
+        if (a->refs++ == 0) {
+            idle_unlink(s, a);
+        }
+        pthread_mutex_unlock(&s->archives_mu);
+        return a;
+    }
+
+    char path[PATH_MAX];
+    a = (http_archive*)calloc(1, sizeof(http_archive));
+    if (a == NULL || (a->name = strdup(name)) == NULL ||
+        snprintf(path, sizeof(path), "%s/%s", s->root, name) >= (int)sizeof(path)) {
+        pthread_mutex_unlock(&s->archives_mu);
+        if (a != NULL)
+            free(a->name);
+        free(a);
+        return NULL;
+    }
+    a->opening = true;
+    a->refs = 1;
+    http_archive** bucket = archive_bucket(s, name);
+    a->hash_next = *bucket;
+    *bucket = a;
+    s->n_open++;
+    pthread_mutex_unlock(&s->archives_mu);
+
+    bool ok = archive_open(a, path, true);
+
+    pthread_mutex_lock(&s->archives_mu);
+    a->opening = false;
+    http_archive* closed = NULL;
+    if (ok) {
+        closed = archive_trim(s);
+    } else {
+        archive_unhash(s, a);
+        s->n_open--;
+    }
+    pthread_cond_broadcast(&s->archive_opened);
+    pthread_mutex_unlock(&s->archives_mu);
+    archive_close(closed);
+
+    if (!ok) {
+        free(a->name);
+        free(a);
+        return NULL;
+    }
+    return a;
+}
+
+static void archive_release(http_server* s, http_archive* a) {
+    if (a == NULL || a == s->single) {
+        return;
+    }
+    pthread_mutex_lock(&s->archives_mu);
+    if (--a->refs == 0) {
+        a->prev = NULL;
+        a->next = s->idle_first;
+        if (s->idle_first)
+            s->idle_first->prev = a;
+        else
+            s->idle_last = a;
+        s->idle_first = a;
+    }
+    http_archive* closed = archive_trim(s);
+    pthread_mutex_unlock(&s->archives_mu);
+    archive_close(closed);
+}
+
+/* responses, built by workers (or by the event loop for bad requests) */
+
+static const char CONTENT_400[] =
+    "<html><head><title>400 Bad request</title></head><body><h1>400 "
+    "Bad request</h1></body></html>\r\n";
 static const char CONTENT_404[] =
-    "HTTP/1.1 404 File not found\r\nConnection: close\r\nContent-Type: text/html; "
-    "charset=iso-8859-1\r\n\r\n<html><head><title>404 File Not Found</title></head><body><h1>404 "
+    "<html><head><title>404 File Not Found</title></head><body><h1>404 "
     "File not found</h1></body></html>\r\n";
 static const char CONTENT_500[] =
-    "HTTP/1.1 500 Unknown thing\r\nConnection: close\r\nContent-Type: text/html; "
-    "charset=iso-8859-1\r\n\r\n<html><head><title>500 Unknown thing</title></head><body><h1>500 "
-    "Unknown thing</h1></body></html>\r\n";
-static const char INTERNAL_ERROR[] =
-    "HTTP/1.1 500 Internal error\r\nConnection: close\r\nContent-Type: text/html; "
-    "charset=iso-8859-1\r\n\r\n<html><head><title>500 Unknown thing</title></head><body><h1>500 "
+    "<html><head><title>500 Unknown thing</title></head><body><h1>500 "
     "Server error</h1></body></html>\r\n";
+static const char CONTENT_501[] =
+    "<html><head><title>501 Unknown thing</title></head><body><h1>501 "
+    "Unknown thing</h1></body></html>\r\n";
 
 struct mime_mapping {
     const char* ext;
@@ -226,7 +955,10 @@ static struct mime_mapping mime_types[] = {{".htm", "text/html"},
                                            {".jpeg", "image/jpeg"},
                                            {".jpe", "image/jpeg"},
                                            {".bmp", "image/bitmap"},
-                                           {".png", "image/png"}};
+                                           {".png", "image/png"},
+                                           {".js", "application/javascript"},
+                                           {".txt", "text/plain"},
+                                           {".xml", "text/xml"}};
 
 static const char* lookup_mime(const char* ext) {
     size_t nTypes = sizeof(mime_types) / sizeof(struct mime_mapping);
@@ -238,116 +970,1068 @@ static const char* lookup_mime(const char* ext) {
     return "application/octet-stream";
 }
 
-static void print_entry_index(FILE* fout, chm_entry* e) {
-    fprintf(fout,
-            "<tr>"
-            "<td align=right>%8d\n</td>"
-            "<td><a href=\"%s\">%s</a></td>"
-            "</tr>",
-            (int)e->length, e->path, e->path);
+static bool is_compressible(const char* ctype) {
+    return strncmp(ctype, "text/", 5) == 0 || strcmp(ctype, "application/javascript") == 0;
 }
 
-static void deliver_index(FILE* fout, struct chm_file* file) {
-    fprintf(fout,
-            "HTTP/1.1 200 OK\r\n"
-            "Connection: close\r\n"
-            /* "Content-Length: 1000000\r\n" */
-            "Content-Type: text/html\r\n\r\n"
+/* extra is more header lines, each ending with \r\n. ctype NULL means the
+ * response has no body at all (304) */
+static void start_response(http_conn* c, const char* status, const char* ctype, int64_t len,
+                           const char* extra) {
+    const char* conn = "";
+    if (!c->req.keep_alive) {
+        conn = "Connection: close\r\n";
+    } else if (c->req.minor_version == 0) {
+        conn = "Connection: keep-alive\r\n";
+    }
+    if (ctype == NULL) {
+        buf_printf(&c->out, "HTTP/1.1 %s\r\n%s%s\r\n", status, conn, extra);
+        return;
+    }
+    buf_printf(&c->out, "HTTP/1.1 %s\r\n%s%sContent-Length: %lld\r\nContent-Type: %s\r\n\r\n",
+               status, conn, extra, (long long)len, ctype);
+}
+
+static void deliver_error(http_conn* c, const char* status, const char* content) {
+    size_t len = strlen(content);
+    start_response(c, status, "text/html; charset=iso-8859-1", (int64_t)len, "");
+    if (c->req.method != METHOD_HEAD) {
+        buf_append(&c->out, content, len);
+    }
+}
 
-            "<h2><u>CHM contents:</u></h2>"
-            "<body><table>"
-            "<tr><td><h5>Size:</h5></td><td><h5>File:</h5></td></tr>"
-            "<tt>");
+static void print_entry_index(http_buf* b, const char* prefix, chm_entry* e) {
+    buf_printf(b,
+               "<tr>"
+               "<td align=right>%8d\n</td>"
+               "<td><a href=\"",
+               (int)e->length);
+    buf_append_url(b, prefix);
+    buf_append_url(b, e->path);
+    buf_printf(b, "\">%s</a></td></tr>", e->path);
+}
+
+static void deliver_page(http_conn* c, http_buf* page) {
+    if (page->oom) {
+        c->out.oom = true;
+    } else {
+        start_response(c, "200 OK", "text/html", (int64_t)page->len, "");
+        if (c->req.method != METHOD_HEAD) {
+            buf_append(&c->out, page->data, page->len);
+        }
+    }
+    buf_free(page);
+}
+
+/* prefix is what the entry paths are under, "/<name>" when serving a directory */
+static void deliver_index(http_conn* c, struct chm_file* file, const char* prefix) {
+    http_buf page = {0};
+    buf_printf(&page,
+               "<h2><u>CHM contents:</u></h2>"
+               "<body><table>"
+               "<tr><td><h5>Size:</h5></td><td><h5>File:</h5></td></tr>"
+               "<tt>");
     for (int i = 0; i < file->n_entries; i++) {
-        print_entry_index(fout, file->entries[i]);
+        print_entry_index(&page, prefix, file->entries[i]);
+    }
+    buf_printf(&page, "</tt> </table></body></html>");
+    deliver_page(c, &page);
+}
+
+#define MAX_LIST_DEPTH 16
+
+/* adds the archives in root/rel and its subdirectories to the listing */
+static void list_archives(http_buf* b, const char* root, const char* rel, int depth) {
+    char path[PATH_MAX];
+    snprintf(path, sizeof(path), "%s%s", root, rel);
+    DIR* dir = opendir(path);
+    if (dir == NULL) {
+        return;
+    }
+    struct dirent* de;
+    while ((de = readdir(dir)) != NULL) {
+        char child[PATH_MAX];
+        struct stat st;
+        /* skips . and .. too */
+        if (de->d_name[0] == '.')
+            continue;
+        if (snprintf(child, sizeof(child), "%s/%s", rel, de->d_name) >= (int)sizeof(child) ||
+            snprintf(path, sizeof(path), "%s%s", root, child) >= (int)sizeof(path) ||
+            stat(path, &st) != 0)
+            continue;
+        if (S_ISDIR(st.st_mode)) {
+            if (depth < MAX_LIST_DEPTH)
+                list_archives(b, root, child, depth + 1);
+        } else if (S_ISREG(st.st_mode) && has_chm_ext(de->d_name, strlen(de->d_name))) {
+            buf_printf(b, "<tr><td align=right>%lld\n</td><td><a href=\"", (long long)st.st_size);
+            buf_append_url(b, child);
+            buf_printf(b, "/\">%s</a></td></tr>", child + 1);
+        }
+    }
+    closedir(dir);
+}
+
+static void deliver_archive_list(http_conn* c) {
+    http_buf page = {0};
+    buf_printf(&page,
+               "<h2><u>CHM files:</u></h2>"
+               "<body><table>"
+               "<tr><td><h5>Size:</h5></td><td><h5>File:</h5></td></tr>"
+               "<tt>");
+    list_archives(&page, c->server->root, "", 0);
+    buf_printf(&page, "</tt> </table></body></html>");
+    deliver_page(c, &page);
+}
+
+/* true if there's room for one more open stream */
+static bool reserve_stream(http_server* s) {
+    pthread_mutex_lock(&s->mu);
+    bool ok = s->n_streams < s->max_streams;
+    if (ok) {
+        s->n_streams++;
     }
+    pthread_mutex_unlock(&s->mu);
+    return ok;
+}
 
-    fprintf(fout, "</tt> </table></body></html>");
+static void unreserve_stream(http_server* s) {
+    pthread_mutex_lock(&s->mu);
+    s->n_streams--;
+    pthread_mutex_unlock(&s->mu);
 }
 
-static int streq(const char* s1, const char* s2) {
-    return strcasecmp(s1, s2) == 0;
+static void close_stream(http_conn* c) {
+    if (c->stream != NULL) {
+        chm_stream_close(c->stream);
+        c->stream = NULL;
+        unreserve_stream(c->server);
+    }
 }
 
-static chm_entry* find_entry_by_path(chm_file* f, const char* path) {
-    chm_entry* e;
-    for (int i = 0; i < f->n_entries; i++) {
-        e = f->entries[i];
-        if (streq(e->path, path)) {
-            return e;
+/* decode the next chunk of the body into c->out */
+static void fill_body(http_conn* c) {
+    int64_t want = c->body_left < BODY_CHUNK ? c->body_left : BODY_CHUNK;
+    int64_t got = -1;
+    if (want > 0 && buf_reserve(&c->out, (size_t)want)) {
+        uint8_t* dst = (uint8_t*)c->out.data + c->out.len;
+        if (c->stream != NULL) {
+            got = chm_stream_read(c->stream, dst, want);
+        } else {
+            got = chm_retrieve_entry(&c->archive->file, c->entry, dst, c->body_off, want);
         }
     }
-    return NULL;
+    if (got > 0) {
+        c->out.len += (size_t)got;
+        c->body_off += got;
+        c->body_left -= got;
+    } else if (c->body_left > 0) {
+        /* Content-Length has been sent, closing the connection is the only way
+         * to tell the client the body is incomplete */
+        c->req.keep_alive = false;
+        c->body_left = 0;
+    }
+    if (c->body_left == 0) {
+        close_stream(c);
+    }
 }
 
-static void deliver_content(FILE* fout, const char* path, struct chm_file* file) {
-    chm_entry* e;
-    const char* ext;
-    unsigned char buffer[65536];
-    int swath, offset;
+/* true if etag is in the If-None-Match list. weak comparison, as RFC 7232 asks */
+static bool etag_listed(const char* list, const char* etag) {
+    size_t n = strlen(etag);
+    const char* p = list;
+    while (*p) {
+        while (*p == ' ' || *p == '\t' || *p == ',')
+            p++;
+        if (*p == '*')
+            return true;
+        if (strncmp(p, "W/", 2) == 0)
+            p += 2;
+        if (strncmp(p, etag, n) == 0 && (p[n] == '\0' || p[n] == ',' || p[n] == ' '))
+            return true;
+        while (*p && *p != ',')
+            p++;
+    }
+    return false;
+}
 
-    if (strcmp(path, "/") == 0) {
-        deliver_index(fout, file);
-        fclose(fout);
-        return;
+static bool parse_offset(const char** s, int64_t* v) {
+    const char* p = *s;
+    if (*p < '0' || *p > '9')
+        return false;
+    int64_t n = 0;
+    for (; *p >= '0' && *p <= '9'; p++) {
+        if (n > (INT64_MAX - 9) / 10)
+            return false;
+        n = n * 10 + (*p - '0');
+    }
+    *v = n;
+    *s = p;
+    return true;
+}
+
+/* parses a Range header against an entry of size len. returns 1 and the range in
+ * *first and *count if it's satisfiable, -1 if it isn't and 0 if the header
+ * should be ignored: malformed, or several ranges, which we don't do */
+static int parse_range(const char* range, int64_t len, int64_t* first, int64_t* count) {
+    int64_t a, b;
+    const char* p = range;
+    if (strncasecmp(p, "bytes=", 6) != 0 || strchr(p, ',') != NULL)
+        return 0;
+    p += 6;
+    while (*p == ' ')
+        p++;
+    if (*p == '-') {
+        /* the last b bytes */
+        p++;
+        if (!parse_offset(&p, &b) || *p != '\0')
+            return 0;
+        if (b == 0 || len == 0)
+            return -1;
+        *first = b < len ? len - b : 0;
+        *count = len - *first;
+        return 1;
+    }
+    if (!parse_offset(&p, &a) || *p++ != '-')
+        return 0;
+    b = INT64_MAX;
+    if (*p != '\0' && (!parse_offset(&p, &b) || b < a))
+        return 0;
+    if (*p != '\0')
+        return 0;
+    if (a >= len)
+        return -1;
+    *first = a;
+    *count = (b < len - 1 ? b : len - 1) - a + 1;
+    return 1;
+}
+/* an entry's bytes can only change if the archive does */
+static void format_etag(char* etag, size_t size, struct chm_file* file, chm_entry* e, int enc) {
+    snprintf(etag, size, "\"%016llx-%d-%llx-%llx%s%s\"", (unsigned long long)file->archive_id,
+             e->space, (unsigned long long)e->start, (unsigned long long)e->length,
+             enc != ENC_IDENTITY ? "-" : "", enc != ENC_IDENTITY ? enc_names[enc] : "");
+}
+
+/* sends e compressed with enc, from the cache or compressing it now. false if
+ * that didn't work out and it should be sent as is */
+static bool deliver_packed(http_conn* c, struct chm_file* file, chm_entry* e, const char* ctype,
+                           int enc) {
+    char etag[80];
+    char extra[256];
+    format_etag(etag, sizeof(etag), file, e, enc);
+    if (c->req.if_none_match[0] != '\0' && etag_listed(c->req.if_none_match, etag)) {
+        snprintf(extra, sizeof(extra), "ETag: %s\r\nVary: Accept-Encoding\r\n", etag);
+        start_response(c, "304 Not modified", NULL, 0, extra);
+        return true;
+    }
+
+    packed_entry* p = pack_lookup(etag);
+    if (p == NULL) {
+        uint8_t* data = (uint8_t*)malloc((size_t)e->length);
+        if (data == NULL) {
+            return false;
+        }
+        if (chm_retrieve_entry(file, e, data, 0, e->length) == e->length) {
+            p = pack_compress(enc, data, (size_t)e->length);
+        }
+        free(data);
+        if (p == NULL) {
+            return false;
+        }
+        strcpy(p->etag, etag);
+        p = pack_insert(p);
+    }
+
+    snprintf(extra, sizeof(extra), "ETag: %s\r\nVary: Accept-Encoding\r\nContent-Encoding: %s\r\n",
+             etag, enc_names[enc]);
+    start_response(c, "200 OK", ctype, (int64_t)p->len, extra);
+    if (c->req.method == METHOD_HEAD) {
+        pack_release(p);
+        return true;
     }
+    c->packed = p;
+    c->packed_off = 0;
+    return true;
+}
 
-    e = find_entry_by_path(file, path);
+static void deliver_content(http_conn* c, struct chm_file* file, const char* path) {
+    chm_entry* e = chm_find_entry(file, path);
     if (e == NULL) {
-        fprintf(fout, CONTENT_404);
-        fclose(fout);
+        deliver_error(c, "404 File not found", CONTENT_404);
         return;
     }
 
-    /* send the file back */
-    ext = strrchr(path, '.');
-    fprintf(
-        fout,
-        "HTTP/1.1 200 OK\r\nConnection: close\r\nContent-Length: %d\r\nContent-Type: %s\r\n\r\n",
-        (int)e->length, lookup_mime(ext));
+    const char* ctype = lookup_mime(strrchr(path, '.'));
+    bool compressible = is_compressible(ctype);
+    /* ranges are served from the entry as is */
+    if (compressible && c->req.range[0] == '\0' && e->length >= PACK_MIN_SIZE &&
+        e->length <= PACK_MAX_SIZE) {
+        int enc = choose_encoding(c->req.accept_encoding);
+        if (enc != ENC_IDENTITY && deliver_packed(c, file, e, ctype, enc)) {
+            return;
+        }
+    }
 
-    /* pump the data out */
-    swath = 65536;
-    offset = 0;
-    while (offset < e->length) {
-        if ((e->length - offset) < 65536)
-            swath = (int)(e->length - offset);
-        else
-            swath = 65536;
-        swath = (int)chm_retrieve_entry(file, e, buffer, offset, swath);
-        offset += swath;
-        fwrite(buffer, 1, (size_t)swath, fout);
-    }
-    fclose(fout);
-}
-
-static void service_request(int fd, struct chm_file* file) {
-    char buffer[4096];
-    char buffer2[4096];
-    char* end;
-    FILE* fout = fdopen(fd, "w+b");
-    if (fout == NULL) {
-        perror("chm_http: failed to fdopen client stream");
-        write(fd, INTERNAL_ERROR, strlen(INTERNAL_ERROR));
-        close(fd);
+    char etag[80];
+    format_etag(etag, sizeof(etag), file, e, ENC_IDENTITY);
+    const char* vary = compressible ? "Vary: Accept-Encoding\r\n" : "";
+    char extra[MAX_HEADER_VALUE + 128];
+    if (c->req.if_none_match[0] != '\0' && etag_listed(c->req.if_none_match, etag)) {
+        snprintf(extra, sizeof(extra), "ETag: %s\r\n%s", etag, vary);
+        start_response(c, "304 Not modified", NULL, 0, extra);
+        return;
+    }
+
+    const char* status = "200 OK";
+    int64_t first = 0;
+    int64_t count = e->length;
+    int n = snprintf(extra, sizeof(extra), "ETag: %s\r\nAccept-Ranges: bytes\r\n%s", etag, vary);
+    /* If-Range: only send the range if the client's copy is still current */
+    if (c->req.range[0] != '\0' &&
+        (c->req.if_range[0] == '\0' || strcmp(c->req.if_range, etag) == 0)) {
+        int res = parse_range(c->req.range, e->length, &first, &count);
+        if (res < 0) {
+            snprintf(extra + n, sizeof(extra) - (size_t)n, "Content-Range: bytes */%lld\r\n",
+                     (long long)e->length);
+            start_response(c, "416 Range not satisfiable", "text/html", 0, extra);
+            return;
+        }
+        if (res > 0) {
+            status = "206 Partial content";
+            snprintf(extra + n, sizeof(extra) - (size_t)n, "Content-Range: bytes %lld-%lld/%lld\r\n",
+                     (long long)first, (long long)(first + count - 1), (long long)e->length);
+        }
+    }
+
+    if (e->space == CHM_UNCOMPRESSED) {
+        /* stored as is: the event loop sends it from the archive with sendfile() */
+        start_response(c, status, ctype, count, extra);
+        if (c->req.method != METHOD_HEAD) {
+            c->file_off = (int64_t)file->itsf.data_offset + e->start + first;
+            c->file_left = count;
+        }
+        return;
+    }
+
+    chm_stream* stream = NULL;
+    bool head = c->req.method == METHOD_HEAD;
+    if (!head && count == e->length && reserve_stream(c->server)) {
+        /* no read-ahead thread: decoding concurrency is bounded by the worker pool */
+        stream = chm_stream_open(file, e, false);
+        if (stream == NULL) {
+            unreserve_stream(c->server);
+            deliver_error(c, "500 Internal error", CONTENT_500);
+            return;
+        }
+    } else if (e->space != CHM_COMPRESSED || !file->compression_enabled) {
+        deliver_error(c, "500 Internal error", CONTENT_500);
+        return;
+    }
+
+    start_response(c, status, ctype, count, extra);
+    if (head) {
+        return;
+    }
+    /* a range, or an entry over the stream cap, only borrows a decoder while
+     * a chunk is decoded */
+    c->stream = stream;
+    c->entry = e;
+    c->body_off = first;
+    c->body_left = count;
+    fill_body(c);
+}
+
+static void deliver_stats(http_conn* c) {
+    http_server* s = c->server;
+    http_buf page = {0};
+    buf_printf(&page, "precompressed responses (");
+    for (int enc = ENC_IDENTITY + 1; enc < ENC_COUNT; enc++) {
+        if (enc_supported(enc)) {
+            buf_printf(&page, " %s", enc_names[enc]);
+        }
+    }
+    pthread_mutex_lock(&g_packs.mu);
+    buf_printf(&page,
+               " ):\n"
+               "  entries:   %d\n"
+               "  bytes:     %lld of %lld (%lld uncompressed)\n"
+               "  hits:      %lld\n"
+               "  misses:    %lld\n"
+               "  evictions: %lld\n",
+               g_packs.n_entries, (long long)g_packs.bytes, (long long)g_packs.limit,
+               (long long)g_packs.orig_bytes, (long long)g_packs.hits, (long long)g_packs.misses,
+               (long long)g_packs.evictions);
+    pthread_mutex_unlock(&g_packs.mu);
+
+    chm_cache_stats st;
+    if (s->single != NULL) {
+        chm_get_cache_stats(&s->single->file, &st);
+    } else {
+        pthread_mutex_lock(&s->archives_mu);
+        buf_printf(&page, "archives:\n  open:      %d of %d\n", s->n_open, config_max_open);
+        pthread_mutex_unlock(&s->archives_mu);
+        chm_get_shared_cache_stats(&st);
+    }
+    buf_printf(&page,
+               "block cache:\n"
+               "  blocks:    %d\n"
+               "  bytes:     %lld of %lld\n"
+               "  hits:      %lld\n"
+               "  misses:    %lld\n"
+               "  evictions: %lld\n",
+               st.n_blocks, (long long)st.bytes, (long long)st.budget, (long long)st.hits,
+               (long long)st.misses, (long long)st.evictions);
+
+    if (page.oom) {
+        c->out.oom = true;
+    } else {
+        start_response(c, "200 OK", "text/plain", (int64_t)page.len, "Cache-Control: no-store\r\n");
+        if (c->req.method != METHOD_HEAD) {
+            buf_append(&c->out, page.data, page.len);
+        }
+    }
+    buf_free(&page);
+}
+
+/* runs on a worker thread */
+static void run_job(http_conn* c) {
+    if (c->body_left > 0) {
+        fill_body(c);
+        return;
+    }
+    http_server* s = c->server;
+    const char* path = c->req.path;
+    if (c->req.method == METHOD_OTHER) {
+        deliver_error(c, "501 Not implemented", CONTENT_501);
         return;
     }
+    if (strcmp(path, "/:stats") == 0) {
+        /* ':' can't be in a .chm path */
+        deliver_stats(c);
+        return;
+    }
+
+    char prefix[MAX_REQUEST];
+    prefix[0] = '\0';
+    if (s->single != NULL) {
+        c->archive = s->single;
+    } else if (strcmp(path, "/") == 0) {
+        deliver_archive_list(c);
+        return;
+    } else {
+        const char* rest;
+        if (!split_archive_path(path, prefix + 1, &rest)) {
+            deliver_error(c, "404 File not found", CONTENT_404);
+            return;
+        }
+        if (*rest == '\0') {
+            /* the archive's index, with a / so relative links work */
+            http_buf loc = {0};
+            buf_printf(&loc, "Location: ");
+            buf_append_url(&loc, path);
+            buf_printf(&loc, "/\r\n");
+            if (loc.oom)
+                c->out.oom = true;
+            else
+                start_response(c, "301 Moved permanently", "text/html", 0, loc.data);
+            buf_free(&loc);
+            return;
+        }
+        c->archive = archive_acquire(s, prefix + 1);
+        if (c->archive == NULL) {
+            deliver_error(c, "404 File not found", CONTENT_404);
+            return;
+        }
+        prefix[0] = '/';
+        path = rest;
+    }
 
-    fgets(buffer, 4096, fout);
+    if (strcmp(path, "/") == 0) {
+        deliver_index(c, &c->archive->file, prefix);
+    } else {
+        deliver_content(c, &c->archive->file, path);
+    }
+}
+
+static void* worker_main(void* param) {
+    http_server* s = (http_server*)param;
+    uint64_t one = 1;
     while (1) {
-        if (fgets(buffer2, 4096, fout) == NULL)
+        pthread_mutex_lock(&s->mu);
+        http_conn* c;
+        while ((c = queue_pop(&s->jobs)) == NULL) {
+            pthread_cond_wait(&s->has_job, &s->mu);
+        }
+        pthread_mutex_unlock(&s->mu);
+
+        run_job(c);
+
+        pthread_mutex_lock(&s->mu);
+        queue_push(&s->done, c);
+        pthread_mutex_unlock(&s->mu);
+        if (write(s->wakefd, &one, sizeof(one)) < 0) {
+            /* the counter can't overflow, the event loop resets it on every wakeup */
+        }
+    }
+    return NULL;
+}
+
+/* request parsing */
+
+/* true if the comma separated list contains token, ignoring case */
+static bool has_token(const char* list, const char* token) {
+    size_t n = strlen(token);
+    const char* p = list;
+    while (*p) {
+        while (*p == ' ' || *p == '\t' || *p == ',')
+            p++;
+        const char* end = p;
+        while (*end && *end != ',')
+            end++;
+        const char* last = end;
+        while (last > p && (last[-1] == ' ' || last[-1] == '\t'))
+            last--;
+        if ((size_t)(last - p) == n && strncasecmp(p, token, n) == 0)
+            return true;
+        p = end;
+    }
+    return false;
+}
+
+/* offset just past the empty line ending the headers, or 0 if there's none yet.
+ * lines may end with \r\n or just \n */
+static size_t find_request_end(const char* data, size_t len) {
+    for (size_t i = 0; i + 1 < len; i++) {
+        if (data[i] != '\n')
+            continue;
+        if (data[i + 1] == '\n')
+            return i + 2;
+        if (data[i + 1] == '\r' && i + 2 < len && data[i + 2] == '\n')
+            return i + 3;
+    }
+    return 0;
+}
+
+static int hex_value(char c) {
+    if (c >= '0' && c <= '9')
+        return c - '0';
+    if (c >= 'a' && c <= 'f')
+        return c - 'a' + 10;
+    if (c >= 'A' && c <= 'F')
+        return c - 'A' + 10;
+    return -1;
+}
+
+/* decodes the path part of target into dst, dropping any query. false if it
+ * has a %00 in it, which can't be in a path */
+static bool url_decode(char* dst, const char* target) {
+    const char* p = target;
+    for (; *p && *p != '?'; p++) {
+        int hi, lo;
+        if (*p == '%' && (hi = hex_value(p[1])) >= 0 && (lo = hex_value(p[2])) >= 0) {
+            *dst = (char)(hi * 16 + lo);
+            if (*dst == '\0')
+                return false;
+            p += 2;
+        } else {
+            *dst = *p;
+        }
+        dst++;
+    }
+    *dst = '\0';
+    return true;
+}
+
+/* values too long to fit are dropped: any header we look at is short unless
+ * it's junk */
+static void copy_value(char* dst, const char* value) {
+    size_t n = strlen(value);
+    while (n > 0 && (value[n - 1] == ' ' || value[n - 1] == '\t'))
+        n--;
+    if (n >= MAX_HEADER_VALUE)
+        n = 0;
+    memcpy(dst, value, n);
+    dst[n] = '\0';
+}
+
+/* hdr is the nul-terminated request line and headers */
+static bool parse_request(char* hdr, http_request* r) {
+    memset(r, 0, offsetof(http_request, path));
+    r->path[0] = '\0';
+
+    char* line = hdr;
+    char* next = strchr(line, '\n');
+    *next++ = '\0';
+    if (next - line > 1 && next[-2] == '\r')
+        next[-2] = '\0';
+
+    /* METHOD SP target SP HTTP/1.x */
+    char* target = strchr(line, ' ');
+    if (target == NULL)
+        return false;
+    *target++ = '\0';
+    char* version = strrchr(target, ' ');
+    if (version == NULL)
+        return false;
+    *version++ = '\0';
+    if (strncmp(version, "HTTP/1.", 7) != 0 || target[0] != '/')
+        return false;
+    r->minor_version = version[7] == '0' ? 0 : 1;
+    r->keep_alive = r->minor_version > 0;
+    if (strcmp(line, "GET") == 0)
+        r->method = METHOD_GET;
+    else if (strcmp(line, "HEAD") == 0)
+        r->method = METHOD_HEAD;
+    else
+        r->method = METHOD_OTHER;
+    if (!url_decode(r->path, target))
+        return false;
+
+    for (line = next; *line != '\0'; line = next) {
+        next = strchr(line, '\n');
+        if (next == NULL)
             break;
-        if (buffer2[0] == '\r' || buffer2[0] == '\n' || buffer2[0] == '\0')
+        *next++ = '\0';
+        if (next - line > 1 && next[-2] == '\r')
+            next[-2] = '\0';
+        char* value = strchr(line, ':');
+        if (value == NULL)
+            continue;
+        *value++ = '\0';
+        while (*value == ' ' || *value == '\t')
+            value++;
+
+        if (strcasecmp(line, "Connection") == 0) {
+            if (has_token(value, "close"))
+                r->keep_alive = false;
+            else if (has_token(value, "keep-alive"))
+                r->keep_alive = true;
+        } else if (strcasecmp(line, "Range") == 0) {
+            copy_value(r->range, value);
+        } else if (strcasecmp(line, "If-Range") == 0) {
+            copy_value(r->if_range, value);
+        } else if (strcasecmp(line, "If-None-Match") == 0) {
+            copy_value(r->if_none_match, value);
+        } else if (strcasecmp(line, "Accept-Encoding") == 0) {
+            copy_value(r->accept_encoding, value);
+        } else if (strcasecmp(line, "Content-Length") == 0) {
+            /* we don't read request bodies, so we can't find where the next
+             * request starts */
+            if (atoll(value) != 0)
+                r->keep_alive = false;
+        } else if (strcasecmp(line, "Transfer-Encoding") == 0) {
+            r->keep_alive = false;
+        }
+    }
+    return true;
+}
+
+/* the event loop */
+
+static void set_events(http_conn* c, uint32_t events) {
+    if (c->events == events) {
+        return;
+    }
+    struct epoll_event ev;
+    memset(&ev, 0, sizeof(ev));
+    ev.events = events;
+    ev.data.ptr = c;
+    epoll_ctl(c->server->epfd, EPOLL_CTL_MOD, c->fd, &ev);
+    c->events = events;
+}
+
+static void close_conn(http_conn* c) {
+    http_server* s = c->server;
+    if (c->fd < 0) {
+        return;
+    }
+    epoll_ctl(s->epfd, EPOLL_CTL_DEL, c->fd, NULL);
+    close(c->fd);
+    c->fd = -1;
+    if (c->prev)
+        c->prev->next = c->next;
+    else
+        s->conns = c->next;
+    if (c->next)
+        c->next->prev = c->prev;
+    /* a worker owns it, it's freed when the worker is done */
+    if (c->state != CONN_WORKING) {
+        queue_push(&s->dead, c);
+    }
+}
+
+static void free_conn(http_conn* c) {
+    close_stream(c);
+    pack_release(c->packed);
+    archive_release(c->server, c->archive);
+    buf_free(&c->out);
+    free(c);
+}
+
+static void submit_job(http_conn* c) {
+    http_server* s = c->server;
+    c->state = CONN_WORKING;
+    set_events(c, 0);
+    pthread_mutex_lock(&s->mu);
+    queue_push(&s->jobs, c);
+    pthread_cond_signal(&s->has_job);
+    pthread_mutex_unlock(&s->mu);
+}
+
+static void process_input(http_conn* c);
+
+/* sends data[*pos..len). false if the socket is full (we'll be back when it
+ * isn't) or the connection got closed */
+static bool send_all(http_conn* c, const char* data, size_t len, size_t* pos, bool more) {
+    int flags = MSG_NOSIGNAL | (more ? MSG_MORE : 0);
+    while (*pos < len) {
+        ssize_t n = send(c->fd, data + *pos, len - *pos, flags);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                set_events(c, EPOLLOUT);
+                return false;
+            }
+            close_conn(c);
+            return false;
+        }
+        *pos += (size_t)n;
+        c->last_active = time(NULL);
+    }
+    return true;
+}
+
+/* send as much of the response as the socket takes */
+static void flush_out(http_conn* c) {
+    http_buf* b = &c->out;
+    c->state = CONN_WRITING;
+    if (b->oom) {
+        close_conn(c);
+        return;
+    }
+    bool more = c->file_left > 0 || c->packed != NULL;
+    if (!send_all(c, b->data, b->len, &b->pos, more)) {
+        return;
+    }
+    buf_reset(b);
+
+    if (c->packed != NULL) {
+        if (!send_all(c, (const char*)c->packed->data, c->packed->len, &c->packed_off, false)) {
+            return;
+        }
+        pack_release(c->packed);
+        c->packed = NULL;
+    }
+
+    while (c->file_left > 0) {
+        off_t off = (off_t)c->file_off;
+        size_t len = c->file_left < SENDFILE_CHUNK ? (size_t)c->file_left : SENDFILE_CHUNK;
+        ssize_t n = sendfile(c->fd, c->archive->ctx.fd, &off, len);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                set_events(c, EPOLLOUT);
+                return;
+            }
+            close_conn(c);
+            return;
+        }
+        if (n == 0) {
+            /* the archive is shorter than its directory says */
+            c->req.keep_alive = false;
+            c->file_left = 0;
             break;
+        }
+        c->file_off += n;
+        c->file_left -= n;
+        c->last_active = time(NULL);
+        if (c->file_left > 0) {
+            /* give other connections a turn */
+            set_events(c, EPOLLOUT);
+            return;
+        }
+    }
+
+    if (c->body_left > 0) {
+        submit_job(c);
+        return;
+    }
+    /* response complete */
+    archive_release(c->server, c->archive);
+    c->archive = NULL;
+    if (!c->req.keep_alive) {
+        close_conn(c);
+        return;
+    }
+    c->state = CONN_READING;
+    process_input(c);
+}
+
+/* starts on the next request if it has fully arrived */
+static void process_input(http_conn* c) {
+    /* empty lines between requests are allowed */
+    size_t skip = 0;
+    while (skip < c->in_len && (c->in[skip] == '\r' || c->in[skip] == '\n'))
+        skip++;
+    size_t end = find_request_end(c->in + skip, c->in_len - skip);
+    if (end == 0) {
+        if (skip > 0) {
+            memmove(c->in, c->in + skip, c->in_len - skip);
+            c->in_len -= skip;
+        }
+        if (c->in_len == sizeof(c->in)) {
+            /* request too large */
+            c->req.method = METHOD_GET;
+            c->req.minor_version = 1;
+            c->req.keep_alive = false;
+            deliver_error(c, "400 Bad request", CONTENT_400);
+            flush_out(c);
+            return;
+        }
+        set_events(c, EPOLLIN);
+        return;
+    }
+
+    char hdr[MAX_REQUEST + 1];
+    memcpy(hdr, c->in + skip, end);
+    hdr[end] = '\0';
+    end += skip;
+    memmove(c->in, c->in + end, c->in_len - end);
+    c->in_len -= end;
+
+    if (!parse_request(hdr, &c->req)) {
+        c->req.method = METHOD_GET;
+        c->req.keep_alive = false;
+        deliver_error(c, "400 Bad request", CONTENT_400);
+        flush_out(c);
+        return;
+    }
+    submit_job(c);
+}
+
+static void read_input(http_conn* c) {
+    ssize_t n = recv(c->fd, c->in + c->in_len, sizeof(c->in) - c->in_len, 0);
+    if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)) {
+        return;
     }
-    end = strrchr(buffer, ' ');
-    if (strncmp(end + 1, "HTTP", 4) == 0)
-        *end = '\0';
-    if (strncmp(buffer, "GET ", 4) == 0)
-        deliver_content(fout, buffer + 4, file);
-    else {
-        fprintf(fout, CONTENT_500);
-        fclose(fout);
+    if (n <= 0) {
+        close_conn(c);
         return;
     }
+    c->in_len += (size_t)n;
+    c->last_active = time(NULL);
+    process_input(c);
+}
+
+static void on_conn_event(http_conn* c, uint32_t events) {
+    if (c->fd < 0) {
+        return;
+    }
+    if (events & EPOLLERR) {
+        close_conn(c);
+    } else if (c->state == CONN_READING) {
+        read_input(c);
+    } else if (c->state == CONN_WRITING) {
+        flush_out(c);
+    } else if (events & EPOLLHUP) {
+        close_conn(c);
+    }
+}
+
+static void accept_conns(http_server* s) {
+    int one = 1;
+    while (1) {
+        int fd = accept4(s->socket, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (fd < 0) {
+            if (errno == EINTR || errno == ECONNABORTED)
+                continue;
+            /* EAGAIN, or out of fds: try again on the next wakeup */
+            return;
+        }
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+        http_conn* c = (http_conn*)calloc(1, sizeof(http_conn));
+        if (c == NULL) {
+            close(fd);
+            continue;
+        }
+        c->server = s;
+        c->fd = fd;
+        c->state = CONN_READING;
+        c->events = EPOLLIN;
+        c->last_active = time(NULL);
+
+        struct epoll_event ev;
+        memset(&ev, 0, sizeof(ev));
+        ev.events = EPOLLIN;
+        ev.data.ptr = c;
+        if (epoll_ctl(s->epfd, EPOLL_CTL_ADD, fd, &ev) < 0) {
+            close(fd);
+            free(c);
+            continue;
+        }
+        c->next = s->conns;
+        if (s->conns)
+            s->conns->prev = c;
+        s->conns = c;
+    }
+}
+
+/* take back connections the workers are done with */
+static void finish_jobs(http_server* s) {
+    uint64_t n;
+    if (read(s->wakefd, &n, sizeof(n)) < 0) {
+        /* nothing to do, another wakeup already took them */
+    }
+    pthread_mutex_lock(&s->mu);
+    conn_queue done = s->done;
+    s->done.first = NULL;
+    s->done.last = NULL;
+    pthread_mutex_unlock(&s->mu);
+
+    http_conn* c;
+    while ((c = queue_pop(&done)) != NULL) {
+        if (c->fd < 0) {
+            /* closed while the worker had it */
+            free_conn(c);
+            continue;
+        }
+        flush_out(c);
+    }
+}
+
+static void close_idle(http_server* s, time_t now) {
+    http_conn* next;
+    for (http_conn* c = s->conns; c != NULL; c = next) {
+        next = c->next;
+        if (c->state != CONN_WORKING && now - c->last_active > IDLE_TIMEOUT) {
+            close_conn(c);
+        }
+    }
+}
+
+static bool start_workers(http_server* s) {
+    int n = config_threads;
+    if (n <= 0) {
+        long ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+        n = ncpu > 0 ? (int)ncpu : 1;
+    }
+    s->max_streams = n;
+    for (int i = 0; i < n; i++) {
+        pthread_t tid;
+        if (pthread_create(&tid, NULL, worker_main, s) != 0) {
+            s->max_streams = i;
+            return i > 0;
+        }
+        pthread_detach(tid);
+    }
+    return true;
+}
+
+static int event_loop(http_server* s) {
+    struct epoll_event events[MAX_EVENTS];
+    time_t last_sweep = time(NULL);
+    while (1) {
+        int n = epoll_wait(s->epfd, events, MAX_EVENTS, 1000);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            perror("epoll_wait");
+            return 4;
+        }
+        for (int i = 0; i < n; i++) {
+            void* p = events[i].data.ptr;
+            if (p == &s->socket) {
+                accept_conns(s);
+            } else if (p == &s->wakefd) {
+                finish_jobs(s);
+            } else {
+                on_conn_event((http_conn*)p, events[i].events);
+            }
+        }
+        time_t now = time(NULL);
+        if (now != last_sweep) {
+            close_idle(s, now);
+            last_sweep = now;
+        }
+        /* events later in the same batch could still have referred to them */
+        http_conn* c;
+        while ((c = queue_pop(&s->dead)) != NULL) {
+            free_conn(c);
+        }
+    }
+}
+
+static bool watch(http_server* s, int fd, void* ptr) {
+    struct epoll_event ev;
+    memset(&ev, 0, sizeof(ev));
+    ev.events = EPOLLIN;
+    ev.data.ptr = ptr;
+    return epoll_ctl(s->epfd, EPOLL_CTL_ADD, fd, &ev) == 0;
+}
+
+static int chmhttp_server(const char* path) {
+    static http_server server;
+    struct sockaddr_in bindAddr;
+    int one = 1;
+
+    struct stat st;
+    if (stat(path, &st) != 0) {
+        fprintf(stderr, "failed to open %s\n", path);
+        return 1;
+    }
+    if (S_ISDIR(st.st_mode)) {
+        server.root = path;
+        pthread_mutex_init(&server.archives_mu, NULL);
+        pthread_cond_init(&server.archive_opened, NULL);
+    } else {
+        static http_archive single;
+        if (!archive_open(&single, path, false)) {
+            fprintf(stderr, "couldn't open file '%s'\n", path);
+            return 2;
+        }
+        server.single = &single;
+    }
+    pthread_mutex_init(&g_packs.mu, NULL);
+    g_packs.limit = (int64_t)config_pack_cache << 20;
+
+    /* a dropped connection shows up as an error from send() */
+    signal(SIGPIPE, SIG_IGN);
+
+    server.socket = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    memset(&bindAddr, 0, sizeof(struct sockaddr_in));
+    bindAddr.sin_family = AF_INET;
+    bindAddr.sin_port = htons(config_port);
+    bindAddr.sin_addr.s_addr = inet_addr(config_bind);
+
+    if (setsockopt(server.socket, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one))) {
+        perror("setsockopt");
+        return 3;
+    }
+
+    if (bind(server.socket, (struct sockaddr*)&bindAddr, sizeof(struct sockaddr_in)) < 0) {
+        close(server.socket);
+        server.socket = -1;
+        fprintf(stderr, "couldn't bind to ip %s port %d\n", config_bind, config_port);
+        return 3;
+    }
+
+    /* listen for connections */
+    listen(server.socket, SOMAXCONN);
+
+    pthread_mutex_init(&server.mu, NULL);
+    pthread_cond_init(&server.has_job, NULL);
+    server.epfd = epoll_create1(EPOLL_CLOEXEC);
+    server.wakefd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (server.epfd < 0 || server.wakefd < 0 || !watch(&server, server.socket, &server.socket) ||
+        !watch(&server, server.wakefd, &server.wakefd)) {
+        perror("chm_http: failed to set up the event loop");
+        return 4;
+    }
+    if (!start_workers(&server)) {
+        fprintf(stderr, "couldn't start worker threads\n");
+        return 4;
+    }
+    return event_loop(&server);
 }
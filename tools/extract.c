@@ -156,21 +156,40 @@ static bool extract(chm_file* h, const char* base_path) {
     return true;
 }
 
-static bool extract_fd(const char* path, const char* base_path) {
+/* pulls a single entry out without reading the whole directory */
+static bool extract_one(chm_file* h, const char* entry_path, const char* base_path) {
+    chm_entry* e = chm_find_entry(h, entry_path);
+    if (e == NULL) {
+        fprintf(stderr, "%s not found\n", entry_path);
+        return false;
+    }
+    return extract_entry(h, e, base_path);
+}
+
+static bool extract_fd(const char* path, const char* base_path, const char* entry_path) {
     fd_reader_ctx ctx;
     if (!fd_reader_init(&ctx, path)) {
         fprintf(stderr, "failed to open %s\n", path);
         return false;
     }
     chm_file f;
-    bool ok = chm_parse(&f, fd_reader, &ctx);
+    bool ok;
+    if (entry_path != NULL) {
+        ok = chm_parse_lazy(&f, fd_reader, &ctx);
+    } else {
+        ok = chm_parse(&f, fd_reader, &ctx);
+    }
     if (!ok) {
         fprintf(stderr, "chm_parse() failed\n");
         fd_reader_close(&ctx);
         return false;
     }
     printf("%s:\n", path);
-    ok = extract(&f, base_path);
+    if (entry_path != NULL) {
+        ok = extract_one(&f, entry_path, base_path);
+    } else {
+        ok = extract(&f, base_path);
+    }
     chm_close(&f);
     fd_reader_close(&ctx);
     return ok;
@@ -178,11 +197,11 @@ static bool extract_fd(const char* path, const char* base_path) {
 
 int main(int c, char** v) {
     if (c < 3) {
-        fprintf(stderr, "usage: %s <chmfile> <outdir>\n", v[0]);
+        fprintf(stderr, "usage: %s <chmfile> <outdir> [path]\n", v[0]);
         exit(1);
     }
 
-    bool ok = extract_fd(v[1], v[2]);
+    bool ok = extract_fd(v[1], v[2], c > 3 ? v[3] : NULL);
     if (!ok) {
         printf("   *** ERROR ***\n");
     }
@@ -15,6 +15,25 @@
 
 #include "sha1.h"
 
+/* how entries are read, picked with a flag. Every mode must print the same
+   lines, so that each read path can be checked against the reference output */
+enum {
+    MODE_ENTRY, /* chm_retrieve_entry() */
+    MODE_BATCH, /* chm_retrieve_entries() */
+    MODE_MMAP,  /* mmap_reader, plus chm_map_entry() and chm_map_block() checked
+                   against chm_retrieve_entry() */
+    MODE_LAZY,  /* every path of the full listing looked up with chm_find_entry()
+                   in a handle opened with chm_parse_lazy() */
+    MODE_CHECKPOINTS, /* chm_retrieve_entry() in reverse order, with checkpoints
+                         and a one block cache, so most reads seek backwards */
+    MODE_RANGE, /* chm_decompress_range() for compressed entries */
+    MODE_STREAM, /* chm_stream with read-ahead */
+};
+
+static const char* mode_flags[] = {"entry", "batch", "mmap", "lazy", "checkpoints", "range", "stream", NULL};
+
+static int mode = MODE_ENTRY;
+
 /* return true if s contains ',' */
 static bool needs_csv_escaping(const char* s) {
     while (*s && (*s != ',')) {
@@ -47,7 +66,12 @@ static uint8_t* extract_entry(struct chm_file* h, chm_entry* e) {
     }
     buf[len] = 0; /* null-terminate just in case */
 
-    int64_t n = chm_retrieve_entry(h, e, buf, 0, len);
+    int64_t n;
+    if (mode == MODE_RANGE && e->space == CHM_COMPRESSED) {
+        n = chm_decompress_range(h, buf, e->start, len, 0);
+    } else {
+        n = chm_retrieve_entry(h, e, buf, 0, len);
+    }
     if (n != len) {
         free(buf);
         return NULL;
@@ -55,7 +79,25 @@ static uint8_t* extract_entry(struct chm_file* h, chm_entry* e) {
     return buf;
 }
 
-static bool process_entry(struct chm_file* h, chm_entry* e) {
+/* sha1 of every entry, for the modes that don't read entries in the order they're printed */
+typedef struct entry_hash {
+    sha1_state state;
+    bool failed;
+} entry_hash;
+
+static bool hash_piece(void* ctx, int i, const uint8_t* data, int64_t off, int64_t len) {
+    entry_hash* h = (entry_hash*)ctx + i;
+    (void)off;
+    if (data == NULL) {
+        h->failed = true;
+        return true;
+    }
+    return sha1_process(&h->state, data, (unsigned long)len) == CRYPT_OK;
+}
+
+/* with batch, hash is the entry's state filled by chm_retrieve_entries().
+   Otherwise the entry is read with chm_retrieve_entry() */
+static bool process_entry(struct chm_file* h, chm_entry* e, entry_hash* hash) {
     char buf[128] = {0};
     uint8_t sha1[20] = {0};
     char sha1Hex[41] = {0};
@@ -72,7 +114,11 @@ static bool process_entry(struct chm_file* h, chm_entry* e) {
     else if (isFile)
         strcat(buf, "file");
 
-    if (e->length > 0) {
+    if (e->length > 0 && hash != NULL) {
+        if (!hash->failed && sha1_done(&hash->state, sha1) != CRYPT_OK) {
+            return false;
+        }
+    } else if (e->length > 0) {
         uint8_t* d = extract_entry(h, e);
         if (d != NULL) {
             int err = sha1_process_all(d, (unsigned long)e->length, sha1);
@@ -94,34 +140,202 @@ static bool process_entry(struct chm_file* h, chm_entry* e) {
     return true;
 }
 
+/* with batch, entries are read in storage order by chm_retrieve_entries(). The
+   output must be the same either way */
+/* compare what chm_map_entry() and chm_map_block() point to with the same bytes
+   read through chm_retrieve_entry() */
+static bool check_mapped(chm_file* h) {
+    for (int i = 0; i < h->n_entries; i++) {
+        chm_entry* e = h->entries[i];
+        if (e->space != CHM_UNCOMPRESSED || e->length <= 0) {
+            continue;
+        }
+        const uint8_t* m = chm_map_entry(h, e);
+        uint8_t* d = extract_entry(h, e);
+        bool same = (m == NULL) == (d == NULL);
+        if (m != NULL && d != NULL) {
+            same = memcmp(m, d, (size_t)e->length) == 0;
+        }
+        free(d);
+        if (!same) {
+            printf("   *** ERROR *** chm_map_entry() differs for %s\n", e->path);
+            return false;
+        }
+    }
+    if (!h->compression_enabled) {
+        return true;
+    }
+    for (uint32_t b = 0; b < h->reset_table.block_count; b++) {
+        int64_t len = 0;
+        const uint8_t* m = chm_map_block(h, b, &len);
+        uint8_t* d = m == NULL ? NULL : (uint8_t*)malloc((size_t)len + 1);
+        bool same = d != NULL && chm_retrieve_entry(h, h->cn_unit, d, h->block_offsets[b], len) == len &&
+                    memcmp(m, d, (size_t)len) == 0;
+        free(d);
+        if (!same) {
+            printf("   *** ERROR *** chm_map_block() differs for block %d\n", (int)b);
+            return false;
+        }
+    }
+    return true;
+}
+
+/* hash the entries last to first into hashes */
+static bool hash_backwards(chm_file* h, entry_hash* hashes) {
+    for (int i = h->n_entries - 1; i >= 0; i--) {
+        chm_entry* e = h->entries[i];
+        if (e->length <= 0) {
+            continue;
+        }
+        uint8_t* d = extract_entry(h, e);
+        if (d == NULL) {
+            hashes[i].failed = true;
+            continue;
+        }
+        int err = sha1_process(&hashes[i].state, d, (unsigned long)e->length);
+        free(d);
+        if (err != CRYPT_OK) {
+            return false;
+        }
+    }
+    return true;
+}
+
+/* hash the entries through streams with read-ahead. reads alternate between less
+   than a block and more than two, so they both split and span blocks */
+static bool hash_streams(chm_file* h, entry_hash* hashes) {
+    int64_t bufLen = 65536 + 7919;
+    uint8_t* buf = (uint8_t*)malloc((size_t)bufLen);
+    if (buf == NULL) {
+        return false;
+    }
+    bool ok = true;
+    for (int i = 0; ok && i < h->n_entries; i++) {
+        chm_entry* e = h->entries[i];
+        if (e->length <= 0) {
+            continue;
+        }
+        chm_stream* s = chm_stream_open(h, e, true);
+        int64_t total = 0;
+        for (int n = 0; s != NULL && total < e->length; n++) {
+            int64_t got = chm_stream_read(s, buf, n % 2 == 0 ? 7919 : bufLen);
+            if (got <= 0) {
+                break;
+            }
+            ok = sha1_process(&hashes[i].state, buf, (unsigned long)got) == CRYPT_OK;
+            total += got;
+        }
+        hashes[i].failed = total != e->length;
+        if (s != NULL) {
+            chm_stream_close(s);
+        }
+    }
+    free(buf);
+    return ok;
+}
+
 static bool test_chm(chm_file* h) {
+    entry_hash* hashes = NULL;
+    if (mode == MODE_BATCH || mode == MODE_CHECKPOINTS || mode == MODE_STREAM) {
+        hashes = (entry_hash*)calloc((size_t)h->n_entries + 1, sizeof(entry_hash));
+        if (hashes == NULL) {
+            return false;
+        }
+        for (int i = 0; i < h->n_entries; i++) {
+            sha1_init(&hashes[i].state);
+        }
+        bool ok;
+        if (mode == MODE_BATCH) {
+            ok = chm_retrieve_entries(h, h->entries, h->n_entries, hash_piece, hashes);
+        } else if (mode == MODE_STREAM) {
+            ok = hash_streams(h, hashes);
+        } else {
+            /* a checkpoint after every block, more than fit in the slots */
+            chm_set_cache_size(h, 1);
+            ok = chm_set_checkpoint_interval(h, 1, 8) && hash_backwards(h, hashes);
+        }
+        if (!ok) {
+            printf("   *** ERROR ***\n");
+            free(hashes);
+            return false;
+        }
+    }
+    if (mode == MODE_MMAP && !check_mapped(h)) {
+        return false;
+    }
     for (int i = 0; i < h->n_entries; i++) {
-        if (!process_entry(h, h->entries[i])) {
+        if (!process_entry(h, h->entries[i], hashes ? &hashes[i] : NULL)) {
             printf("   *** ERROR ***\n");
+            free(hashes);
             return false;
         }
     }
+    free(hashes);
     if (h->parse_entries_failed) {
         printf("   *** ERROR ***\n");
     }
     return true;
 }
 
-static bool test_fd(const char* path) {
-    fd_reader_ctx ctx;
-    if (!fd_reader_init(&ctx, path)) {
-        fprintf(stderr, "failed to open %s\n", path);
+/* the entries of full, found through the PMGI index of a lazily parsed handle
+   on the same file */
+static bool test_lazy(chm_file* full, chm_reader reader, void* ctx) {
+    chm_file f;
+    if (!chm_parse_lazy(&f, reader, ctx)) {
+        fprintf(stderr, "chm_parse_lazy() failed\n");
         return false;
     }
+    bool ok = true;
+    for (int i = 0; ok && i < full->n_entries; i++) {
+        chm_entry* e = chm_find_entry(&f, full->entries[i]->path);
+        if (e == NULL) {
+            printf("   *** ERROR *** %s not found\n", full->entries[i]->path);
+            ok = false;
+        } else if (!process_entry(&f, e, NULL)) {
+            printf("   *** ERROR ***\n");
+            ok = false;
+        }
+    }
+    if (ok && full->parse_entries_failed) {
+        printf("   *** ERROR ***\n");
+    }
+    chm_close(&f);
+    return ok;
+}
+
+static bool test_reader(chm_reader reader, void* ctx) {
     chm_file f;
-    bool ok = chm_parse(&f, fd_reader, &ctx);
+    bool ok = chm_parse(&f, reader, ctx);
     if (!ok) {
         fprintf(stderr, "chm_parse() failed\n");
-        fd_reader_close(&ctx);
         return false;
     }
-    ok = test_chm(&f);
+    if (mode == MODE_LAZY) {
+        ok = test_lazy(&f, reader, ctx);
+    } else {
+        ok = test_chm(&f);
+    }
     chm_close(&f);
+    return ok;
+}
+
+static bool test_file(const char* path) {
+    if (mode == MODE_MMAP) {
+        mmap_reader_ctx ctx;
+        if (!mmap_reader_init(&ctx, path)) {
+            fprintf(stderr, "failed to open %s\n", path);
+            return false;
+        }
+        bool ok = test_reader(mmap_reader, &ctx);
+        mmap_reader_close(&ctx);
+        return ok;
+    }
+    fd_reader_ctx ctx;
+    if (!fd_reader_init(&ctx, path)) {
+        fprintf(stderr, "failed to open %s\n", path);
+        return false;
+    }
+    bool ok = test_reader(fd_reader, &ctx);
     fd_reader_close(&ctx);
     return ok;
 }
@@ -133,14 +347,25 @@ static void dbg_print(const char* s) {
 }
 
 int main(int c, char** v) {
-    if (c < 2) {
-        fprintf(stderr, "usage: %s <chmfile>\n", v[0]);
+    const char* prog = v[0];
+    if (c == 3) {
+        mode = -1;
+        for (int i = 0; mode_flags[i] != NULL; i++) {
+            if (v[1][0] == '-' && strcmp(v[1] + 1, mode_flags[i]) == 0) {
+                mode = i;
+            }
+        }
+        c--;
+        v++;
+    }
+    if (c != 2 || mode < 0) {
+        fprintf(stderr, "usage: %s [-batch|-mmap|-lazy|-checkpoints|-range|-stream] <chmfile>\n", prog);
         exit(1);
     }
     if (show_dbg_out) {
         chm_set_dbgprint(dbg_print);
     }
-    bool ok = test_fd(v[1]);
+    bool ok = test_file(v[1]);
     if (ok) {
         return 0;
     }
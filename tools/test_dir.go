@@ -48,6 +48,7 @@ var (
 	nFile            int
 	timeStart        time.Time
 	flgCheckRef      bool
+	flgMode          string
 	priorityFiles    = []string{
 		"/Volumes/Store/books/_chm/Automating UNIX And Linux Administration (2003).chm",
 		"/Volumes/Store/books/_chm/Que.Mobile.Guide.to.BlackBerry.May.2005.eBook-LiB.ch",
@@ -137,7 +138,11 @@ func toTrimmedLines(d []byte) []string {
 }
 
 func runTest(path string) ([]byte, []byte, error) {
-	cmd := exec.Command(testExe, path)
+	args := []string{path}
+	if flgMode != "" {
+		args = []string{"-" + flgMode, path}
+	}
+	cmd := exec.Command(testExe, args...)
 
 	var stdout bytes.Buffer
 	var stderr bytes.Buffer
@@ -325,6 +330,7 @@ func testDir(dir string) {
 
 func parseFlags() {
 	flag.BoolVar(&flgCheckRef, "check-ref", false, "run in reference checking mode")
+	flag.StringVar(&flgMode, "mode", "", "how test reads entries: batch, mmap, lazy, checkpoints, range or stream (see tools/test.c)")
 	flag.Parse()
 }
 